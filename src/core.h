@@ -3,15 +3,21 @@
 #include <LittleFS.h>
 #include <RTClib.h>
 #include <sunset.h>
-#include <NTPClient.h>
 #include <WiFiUdp.h>
+#include <ESP8266WiFi.h>
 #include <ESP8266WebServer.h>
 #include <ESP8266HTTPClient.h>
 #include <ESP8266mDNS.h>
+#include <lwip/dns.h>
+#include <new>
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>
 #include "main.h"
 
+extern "C" {
+  #include "user_interface.h"
+}
+
 #ifdef physical_clock
   RTC_DS1307 rtc;
 #else
@@ -22,7 +28,7 @@ ESP8266WebServer server(80);
 WiFiClient wifiClient;
 HTTPClient httpClient;
 WiFiUDP wifiUdp;
-NTPClient ntpClient(wifiUdp);
+WiFiUDP multicastUdp;
 SunSet sun;
 
 const int core_version = 25;
@@ -33,17 +39,155 @@ int last_accessed_log = 0;
 const char days_of_the_week[7][2] = {"s", "o", "u", "e", "h", "r", "a"};
 char host_name[30] = {0};
 
+const int smart_limit = 64;
+const size_t smart_string_limit = 4096;
+const size_t payload_limit = 1280;
+const size_t ntp_server_limit = 64;
+const size_t location_limit = 32;
+const size_t payload_json_size = JSON_OBJECT_SIZE(32) + payload_limit;
+// 31 keys (about 230 characters) with the version, credentials, four addresses, the time server and the location.
+// An older file that still carries the smart string was read into 1024 bytes, which this covers as well.
+const size_t settings_json_size = JSON_OBJECT_SIZE(31) + 256 + 12 + 33 + 65 + 18 + 4 * 16 + ntp_server_limit + 1 + location_limit + 1;
+const size_t smart_json_size = JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(31) + JSON_ARRAY_SIZE(3) + JSON_ARRAY_SIZE(2) + 224;
+const size_t smart_raw_json_size = JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(8) + 128; // The smart strings are added at their real length.
+StaticJsonDocument<payload_json_size> payload_json;
+String raw_body = "";
+bool raw_too_large = false;
+StaticJsonDocument<settings_json_size> settings_json;
+
 struct Device {
-  String ip;
+  IPAddress ip;
   String mac;
+  uint32_t seen_u_time;
+  int uprisings;
+  uint32_t sequence;
 };
 
-Device *devices_array;
+const int devices_limit = 16;
+const int devices_ttl = 900;
+Device devices_array[devices_limit];
 int devices_count = 0;
+uint32_t devices_u_time = 0;
+
+const int strangers_limit = 4;
+const int strangers_ttl = 10;
+Device strangers_array[strangers_limit];
+int strangers_index = 0;
+MDNSResponder::hMDNSServiceQuery devices_query = 0;
+
+struct Connection {
+  IPAddress ip;
+  WiFiClient client;
+  uint32_t used_u_time;
+};
+
+const int connections_limit = 4;
+const int connections_idle_time = 30;
+Connection connections_array[connections_limit];
+
+IPAddress multicast_ip(239, 255, 73, 68);
+const int multicast_port = 7368;
+const int multicast_limit = 512;
+bool multicast = false;
+uint32_t multicast_sequence = 0;
 
 String ssid = "";
 String password = "";
+String wifi_bssid = "";
+int wifi_channel = 0;
+IPAddress wifi_ip;
+IPAddress wifi_gateway;
+IPAddress wifi_subnet;
+IPAddress wifi_dns;
+uint32_t wifi_lease_u_time = 0;
+const uint32_t wifi_lease_limit = 86400;
 bool auto_reconnect = false;
+bool services = false;
+
+enum WifiState {
+  wifi_idle,
+  wifi_connecting,
+  wifi_probing,
+  wifi_wps,
+  wifi_connected
+};
+
+const uint32_t wifi_timeout = 5000;
+const uint32_t fast_wifi_timeout = 2000;
+const uint32_t wps_timeout = 120000;
+WifiState wifi_state = wifi_idle;
+bool wifi_use_wps = false;
+bool wifi_fast = false;
+uint32_t wifi_millis = 0;
+volatile bool wifi_got_ip = false;
+volatile bool wifi_lost = false;
+volatile int wps_status = -1;
+WiFiEventHandler wifi_connected_handler;
+WiFiEventHandler wifi_disconnected_handler;
+uint32_t first_response_millis = 0;
+uint32_t services_millis = 0;
+int sync_task = -1;
+const uint32_t sync_connect_timeout = 250;
+const uint32_t sync_timeout = 2000;
+const uint32_t sync_poll_interval = 20000;
+const uint32_t sync_motion_retry = 500000;
+WiFiClient sync_client;
+IPAddress sync_ip;
+int sync_index = -1;
+uint32_t sync_millis = 0;
+String sync_reply = "";
+String sync_log = "";
+
+const String default_ntp_server = "pool.ntp.org";
+String ntp_server = default_ntp_server;
+IPAddress ntp_ip;
+const uint32_t ntp_resolve_interval = 86400;
+uint32_t ntp_resolved_time = 0;
+bool ntp_resolving = false;
+const int ntp_port = 123;
+const int ntp_local_port = 1337;
+const int ntp_packet_size = 48;
+const uint32_t ntp_timeout = 2000;
+const uint32_t ntp_retry_interval = 60;
+const uint32_t ntp_min_interval = 3600;
+const uint32_t ntp_max_interval = 345600;
+uint32_t ntp_interval = ntp_min_interval;
+uint32_t ntp_next_time = 0;
+uint32_t ntp_millis = 0;
+bool ntp_pending = false;
+
+const uint32_t clock_max_probe = 512;
+const uint32_t clock_min_probe = 16;
+const int clock_reads_limit = 60;
+uint32_t clock_u_time = 0;
+uint32_t clock_millis = 0;
+uint32_t clock_read_millis = 0;
+int32_t clock_probe = 0;
+int clock_reads = 0;
+bool clock_running = false;
+int clock_correction = 0;
+bool clock_phase = false;
+
+#ifdef sqw_interrupt
+  const uint32_t sqw_resync_ticks = 60;
+  const uint32_t sqw_timeout = 2000;
+  volatile uint32_t sqw_ticks = 0;
+  volatile uint32_t sqw_millis = 0;
+  uint32_t sqw_seen_ticks = 0;
+  uint32_t sqw_synced_ticks = 0;
+#endif
+
+const uint32_t drift_min_elapsed = 21600;
+const int drift_limit = 500;
+const uint32_t drift_check_interval = 60000;
+const uint32_t drift_write_window = 20;
+int drift = 0;
+int drift_applied = 0;
+int drift_pending = 0;
+int drift_task = -1;
+uint32_t drift_u_time = 0;
+uint32_t drift_millis = 0;
+uint32_t sync_u_time = 0;
 
 uint32_t start_u_time = 0;
 uint32_t loop_u_time = 0;
@@ -99,11 +243,60 @@ struct Smart {
   String must_be_; // This is a fulfillment condition, not a trigger.
   String twilight_must_be_;
   uint32_t lead_u_time;
+  uint32_t evaluations;
+  uint32_t matches;
+  uint32_t fired;
+  uint32_t fired_u_time;
+  uint32_t evaluation_micros;
+  bool merged;
+};
+
+struct Slice {
+  const char *start;
+  unsigned int length;
+};
+
+struct ScheduleEvent {
+  uint32_t u_time;
+  uint8_t smart;
+  int8_t value;
+};
+
+struct SetStream {
+  int depth;
+  bool in_string;
+  bool escape;
+  int unicode;
+  bool key_expected;
+  bool in_key;
+  bool in_smart;
+  bool smart_member;
+  bool smart_limited;
+  bool too_large;
+  unsigned int smart_length;
+  String key;
+  String member;
+  String rest;
+  String rule;
 };
 
 Smart *smart_array;
+int smart_size = 0;
 int smart_count = 0;
 bool smart_lock = false;
+String smart_analysis = "";
+
+int smart_streamed = -1;
+bool smart_stream_changed = false;
+SetStream set_stream;
+
+const int schedule_max_hours = 168;
+ScheduleEvent *schedule_array = 0;
+int schedule_size = 0;
+int schedule_count = 0;
+uint32_t schedule_from = 0;
+uint32_t schedule_to = 0;
+String schedule_conditional = "";
 
 const String default_location = "52.2337172x21.0714322";
 String geo_location = default_location;
@@ -118,38 +311,207 @@ int light_sensor = -1;
 bool sensor_twilight = false;
 bool calendar_twilight = false;
 
+#ifdef metrics
+  enum Metric {
+    loop_metric,
+    handle_client_metric,
+    smart_action_metric,
+    note_metric,
+    save_settings_metric,
+    sleep_metric,
+    sleep_request_metric,
+    metrics_count
+  };
+
+  const char metrics_names[metrics_count][14] = {"loop", "handle_client", "smart_action", "note", "save_settings", "sleep", "sleep_request"};
+  const int metrics_buckets_count = 10;
+  const uint32_t metrics_buckets[metrics_buckets_count] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 500000};
+
+  struct Histogram {
+    uint32_t buckets[metrics_buckets_count];
+    uint32_t count;
+    uint64_t sum;
+  };
+
+  Histogram histograms_array[metrics_count];
+
+  struct Route {
+    const char *uri;
+    uint32_t count;
+  };
+
+  const int routes_limit = 24;
+  Route routes_array[routes_limit];
+  int routes_count = 0;
+  uint32_t other_routes_counter = 0;
+
+  uint32_t steps_counter = 0;
+  uint32_t flash_writes_counter = 0;
+#endif
+
+#ifdef step_trace
+  struct Trace {
+    uint32_t cycles;
+    const char *site;
+  };
+
+  const int traces_limit = 128;
+  Trace traces_array[traces_limit];
+  int traces_index = 0;
+  int traces_count = 0;
+  Trace worst_trace = {0, "motion"};
+  uint32_t trace_step_cycles = 0;
+  uint32_t trace_site_cycles = 0;
+  const char *trace_site = "motion";
+#endif
+
+struct Task {
+  const char *name;
+  void (*callback)();
+  uint32_t period;
+  uint32_t budget;
+  uint32_t deadline;
+  bool active;
+  uint32_t due_micros;
+  uint32_t runs;
+  uint32_t overruns;
+  uint32_t max_runtime;
+  uint64_t runtime;
+};
+
+const int tasks_limit = 12;
+const uint32_t tasks_frame = 2000;
+Task tasks_array[tasks_limit];
+int tasks_count = 0;
+
+const uint32_t sleep_limit = 10000000;
+const uint32_t sleep_task_period = 1000000;
+const uint32_t sleep_poll = 20000;
+const uint32_t sleep_wifi_period = 100000;
+const uint8_t sleep_listen_interval = 3;
+bool idle_sleep = false;
+bool sleeping = false;
+uint32_t sleep_micros = 0;
+uint32_t sleep_request_micros = 0;
+uint32_t sleep_request_latency = 0;
+
 bool strContains(String text, String value);
 bool strContains(String text, int value);
 bool strContains(int text, int value);
 String isStringDigit(String text, String fallback);
 bool isStringDigit(String text);
 String corectDateTime(int digit);
+#ifdef sqw_interrupt
+  void startSQW();
+  void sqwTick();
+#endif
+void readRTC();
+void updateRTC();
+DateTime getDateTime();
+uint64_t getUnixMillis();
+int getMinuteOfDay();
+void adjustRTC(const DateTime& date_time);
 bool RTCisrunning();
 bool hasTimeChanged();
+bool adjustTime(uint32_t u_time, int tolerance);
+void requestTime();
+void resolvedTime(const char *name, const ip_addr_t *ip_addr, void *arg);
+uint32_t receivedTime();
+void syncedTime(uint64_t u_millis);
+void applyDrift();
+void writeDrift();
 void note(String text);
-bool writeObjectToFile(String name, DynamicJsonDocument object);
+int addTask(const char *name, void (*callback)(), uint32_t period, uint32_t budget, uint32_t deadline);
+void wakeTask(int task, uint32_t delay_micros);
+void setTaskPeriod(int task, uint32_t period);
+void runTasks();
+uint32_t nextTaskDue(uint32_t min_period);
+uint32_t nextSmartDue();
+void idleSleep(bool idle);
+bool isRawBody();
+void receivedRawBody();
+bool isPayloadTooLarge();
+bool writeObjectToFile(String name, const JsonDocument& object);
 String get1(String text, int index, char separator);
+bool nextSlice(const String& text, unsigned int& position, char separator, Slice& slice);
+String sliceToString(const Slice& slice);
 String oldSmart2NewSmart(const String& smart_string);
 String getSmartString(bool raw);
 void setSmart(const String& smart_string);
+bool resizeSmart(int size);
+bool loadRules();
+bool saveRules();
+void compileSmart(Smart& smart, String single_smart_string);
+void restoreSmart();
+bool isSameSmart(int i, int j);
+bool hasSmartDays(int i, int j);
+String sharedTrigger(int i, int j);
+String firedAction(int i, String trigger);
+bool canSmartFire(int i);
+String analyzeSmart();
 DynamicJsonDocument getSmartJson(bool raw);
+int verifiedTime(int time);
 void smartAction(int trigger, bool twilight_change);
 void connectingToWifi(bool use_wps);
 void initiatingWPS();
+void startWPS();
+void wpsStatus(wps_cb_status status);
+bool stringToBSSID(String text, uint8_t *bssid);
+void forgetTheLease();
+bool isLeaseValid();
+void connectedToWifi();
+void handleWifi();
 void activationTheLog();
 void deactivationTheLog();
 void requestForLogs();
 void clearTheLog();
 void getSunriseSunset(DateTime now);
+bool isScheduled(int i);
+int scheduleValue(int i, int fallback);
+void addScheduleEvent(uint32_t day_u_time, int minute, int i, int value, int sunrise, int sunset);
+void collectSchedule(DateTime now, int days);
+bool planSchedule(DateTime now, int hours);
+void invalidateSchedule();
 int findMDNSDevices();
+void refreshMDNSDevices();
+void noteDevice(IPAddress ip, String mac);
+void forgetDevice(IPAddress ip);
+void receivedMDNSDevice(MDNSResponder::MDNSServiceInfo service_info, MDNSResponder::AnswerType answer_type, bool set_content);
+WiFiClient& getConnection(IPAddress ip);
+void closeIdleConnections();
+bool isNewSequence(String mac, int uprisings, uint32_t sequence);
+void startMulticast();
+void putMulticastData(String data);
+bool receivedMulticastData();
 void receivedOfflineData();
+void receivedRawOfflineData();
+void clearStream();
+void streamOfflineData(char c);
+void streamSmart(char c);
+void finishStreamMember();
+void streamRule();
+bool finishStreamedSmart();
 void putOfflineData(String url, String data);
 void putMultiOfflineData(String data);
 void putMultiOfflineData(String data, bool log);
 void getOfflineData();
+void nextOfflineData(String log_text);
 void setupOTA();
 void getSmartDetail();
 void getRawSmartDetail();
+const char* route(const char *uri);
+#ifdef metrics
+  void observe(Metric metric, uint32_t start_micros);
+  void countRoute(const String& uri);
+  void requestForMetrics();
+#endif
+#ifdef step_trace
+  void traceSite(const char *site, uint32_t start_cycles);
+  void traceStep();
+  void traceStop();
+  void requestForTrace();
+  void clearTheTrace();
+#endif
 
 
 bool strContains(String text, String value) {
@@ -189,16 +551,119 @@ String corectDateTime(int digit) {
   return String(digit);
 }
 
-bool RTCisrunning() {
+#ifdef sqw_interrupt
+  void startSQW() {
+    rtc.writeSqwPinMode(DS1307_SquareWave1HZ);
+    pinMode(sqw_pin, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(sqw_pin), sqwTick, FALLING);
+  }
+
+  IRAM_ATTR void sqwTick() {
+    sqw_ticks++;
+    sqw_millis = millis();
+  }
+#endif
+
+// Reads land ever closer before the predicted tick, so the cached second converges on the RTC's own boundary.
+// Now and then a read lands just after the tick to catch the cache running ahead of the RTC.
+void readRTC() {
+  uint32_t read_millis = millis();
   #ifdef physical_clock
-    return rtc.isrunning();
-  #else
-    return rtc.now().unixtime() > 1546304461;
+    clock_running = rtc.isrunning();
+  #endif
+  uint32_t u_time = rtc.now().unixtime();
+  #ifndef physical_clock
+    clock_running = u_time > 1546304461;
+  #endif
+
+  uint32_t predicted = clock_u_time + (read_millis - clock_millis) / 1000;
+  if (clock_u_time == 0 || u_time > predicted + 1 || u_time + 1 < predicted) {
+    clock_u_time = u_time;
+    clock_millis = read_millis;
+    clock_probe = clock_max_probe;
+    clock_reads = 0;
+  } else if (u_time > predicted) {
+    clock_u_time = u_time;
+    clock_millis = read_millis;
+  } else if (u_time < predicted) {
+    clock_millis += clock_min_probe;
+  }
+
+  if (clock_reads++ > clock_reads_limit) {
+    clock_probe = -(int32_t)clock_min_probe;
+    clock_reads = 0;
+  } else if (clock_probe < 0) {
+    clock_probe = clock_min_probe;
+  } else if (clock_probe > (int32_t)clock_min_probe) {
+    clock_probe /= 2;
+  }
+
+  clock_read_millis = clock_millis + ((read_millis - clock_millis) / 1000 + 1) * 1000 - clock_probe;
+  if ((int32_t)(clock_read_millis - read_millis) <= 0) {
+    clock_read_millis += 1000;
+  }
+}
+
+void updateRTC() {
+  #ifdef sqw_interrupt
+    noInterrupts();
+    uint32_t ticks = sqw_ticks;
+    uint32_t tick_millis = sqw_millis;
+    interrupts();
+
+    if (clock_u_time > 0 && ticks > 0 && millis() - tick_millis < sqw_timeout) {
+      if (ticks != sqw_seen_ticks) {
+        if (sqw_synced_ticks == 0 || ticks - sqw_synced_ticks >= sqw_resync_ticks) {
+          clock_running = rtc.isrunning();
+          clock_u_time = rtc.now().unixtime();
+          sqw_synced_ticks = ticks;
+        } else {
+          clock_u_time += ticks - sqw_seen_ticks;
+        }
+        clock_millis = tick_millis;
+        sqw_seen_ticks = ticks;
+      }
+      return;
+    }
   #endif
+
+  if (clock_u_time == 0 || (int32_t)(millis() - clock_read_millis) >= 0) {
+    readRTC();
+  }
+}
+
+DateTime getDateTime() {
+  updateRTC();
+  return DateTime(clock_u_time + (millis() - clock_millis) / 1000);
+}
+
+uint64_t getUnixMillis() {
+  updateRTC();
+  return (uint64_t)(clock_u_time - offset - (dst ? 3600 : 0)) * 1000 + (millis() - clock_millis) + clock_correction;
+}
+
+int getMinuteOfDay() {
+  DateTime now = getDateTime();
+  return (now.hour() * 60) + now.minute();
+}
+
+void adjustRTC(const DateTime& date_time) {
+  rtc.adjust(date_time);
+  clock_u_time = 0;
+  clock_correction = 0;
+  clock_phase = false;
+  #ifdef sqw_interrupt
+    sqw_synced_ticks = 0;
+  #endif
+}
+
+bool RTCisrunning() {
+  updateRTC();
+  return clock_running;
 }
 
 bool hasTimeChanged() {
-  int current_u_time = RTCisrunning() ? rtc.now().unixtime() : millis() / 1000;
+  int current_u_time = RTCisrunning() ? getDateTime().unixtime() : millis() / 1000;
   if (abs(current_u_time - (int)loop_u_time) >= 1) {
     loop_u_time = current_u_time;
     return true;
@@ -206,10 +671,216 @@ bool hasTimeChanged() {
   return false;
 }
 
+bool adjustTime(uint32_t u_time, int tolerance) {
+  int new_u_time = u_time + offset + (dst ? 3600 : 0);
+  if (new_u_time <= 1546304461) {
+    return false;
+  }
+
+  if (RTCisrunning()) {
+    if (abs(new_u_time - (int)getDateTime().unixtime()) <= tolerance) {
+      return false;
+    }
+    adjustRTC(DateTime(new_u_time));
+    note("Adjust time");
+  } else {
+    adjustRTC(DateTime(new_u_time));
+    note("RTC begin");
+    start_u_time = (millis() / 1000) + new_u_time - offset - (dst ? 3600 : 0);
+  }
+  return true;
+}
+
+void requestTime() {
+  if (ntp_pending || millis() / 1000 < ntp_next_time) {
+    return;
+  }
+
+  String host = ntp_server;
+  int port = ntp_port;
+  if (ntp_server.indexOf(":") > -1) {
+    host = ntp_server.substring(0, ntp_server.indexOf(":"));
+    port = ntp_server.substring(ntp_server.indexOf(":") + 1).toInt();
+  }
+  // The name is resolved by lwIP in the background and its address kept for a day, whatever happens to the requests.
+  IPAddress ip;
+  if (ip.fromString(host)) {
+    ntp_ip = ip;
+  } else if (!ntp_resolving && (!ntp_ip.isSet() || millis() / 1000 - ntp_resolved_time > ntp_resolve_interval)) {
+    ip_addr_t address;
+    ntp_resolving = true;
+    err_t result = dns_gethostbyname(host.c_str(), &address, resolvedTime, nullptr);
+    if (result == ERR_OK) {
+      resolvedTime(host.c_str(), &address, nullptr);
+    } else if (result != ERR_INPROGRESS) {
+      ntp_resolving = false;
+      ntp_next_time = millis() / 1000 + ntp_retry_interval;
+    }
+  }
+  if (!ntp_ip.isSet()) {
+    return;
+  }
+
+  while (wifiUdp.parsePacket() > 0) {
+    wifiUdp.flush();
+  }
+
+  byte packet[ntp_packet_size] = {0};
+  packet[0] = 0b11100011;
+  ntp_millis = millis();
+  packet[44] = ntp_millis >> 24;
+  packet[45] = ntp_millis >> 16;
+  packet[46] = ntp_millis >> 8;
+  packet[47] = ntp_millis;
+
+  wifiUdp.beginPacket(ntp_ip, port);
+  wifiUdp.write(packet, ntp_packet_size);
+  ntp_pending = wifiUdp.endPacket();
+  if (!ntp_pending) {
+    ntp_next_time = millis() / 1000 + ntp_retry_interval;
+  }
+}
+
+void resolvedTime(const char *name, const ip_addr_t *ip_addr, void *arg) {
+  ntp_resolving = false;
+  if (ip_addr == nullptr) {
+    ntp_next_time = millis() / 1000 + ntp_retry_interval;
+    return;
+  }
+  if (ntp_server.startsWith(name)) {
+    ntp_ip = IPAddress(ip_addr);
+    ntp_resolved_time = millis() / 1000;
+  }
+}
+
+uint32_t receivedTime() {
+  if (!ntp_pending) {
+    return 0;
+  }
+
+  if (wifiUdp.parsePacket() < ntp_packet_size) {
+    if (millis() - ntp_millis > ntp_timeout) {
+      ntp_pending = false;
+      ntp_next_time = millis() / 1000 + ntp_retry_interval;
+    }
+    return 0;
+  }
+
+  byte packet[ntp_packet_size];
+  wifiUdp.read(packet, ntp_packet_size);
+  wifiUdp.flush();
+
+  uint32_t originate = ((uint32_t)packet[28] << 24) | (packet[29] << 16) | (packet[30] << 8) | packet[31];
+  if ((packet[0] & 0b111) != 4 || packet[1] == 0 || originate != ntp_millis) {
+    return 0;
+  }
+  ntp_pending = false;
+
+  uint32_t seconds = ((uint32_t)packet[40] << 24) | (packet[41] << 16) | (packet[42] << 8) | packet[43];
+  uint32_t fraction = ((uint32_t)packet[44] << 24) | (packet[45] << 16) | (packet[46] << 8) | packet[47];
+  uint32_t delay_millis = (((uint64_t)fraction * 1000) >> 32) + (millis() - ntp_millis) / 2;
+  uint64_t u_millis = (uint64_t)(seconds - 2208988800UL) * 1000 + delay_millis;
+
+  syncedTime(u_millis);
+  return (u_millis + 500) / 1000;
+}
+
+void syncedTime(uint64_t u_millis) {
+  uint32_t u_time = (u_millis + 500) / 1000;
+  int64_t error = 0;
+
+  if (RTCisrunning()) {
+    error = (int64_t)(getUnixMillis() - clock_correction - u_millis);
+  }
+  if (RTCisrunning() && clock_phase) {
+    int64_t deviation = error + clock_correction;
+    uint32_t elapsed = u_time - sync_u_time;
+
+    if (sync_u_time > 0 && elapsed >= drift_min_elapsed) {
+      int measured = (deviation + (int64_t)drift_applied * 1000) * 1000 / (int32_t)elapsed;
+      if (abs(measured) <= drift_limit) {
+        measured = drift == 0 ? measured : (drift + measured) / 2;
+        if (drift != measured) {
+          drift = measured;
+          saveSettings(false);
+        }
+      }
+    }
+
+    if (llabs(deviation) <= 250) {
+      ntp_interval = min(ntp_interval * 2, ntp_max_interval);
+    } else {
+      ntp_interval = ntp_min_interval;
+    }
+  }
+
+  sync_u_time = u_time;
+  drift_applied = 0;
+  drift_pending = 0;
+  drift_u_time = u_time + offset + (dst ? 3600 : 0);
+  drift_millis = millis();
+  ntp_next_time = millis() / 1000 + ntp_interval;
+
+  if (!RTCisrunning() || llabs(error) >= 1000) {
+    adjustTime(u_time, 0);
+  } else {
+    clock_correction = -error;
+    clock_phase = true;
+  }
+}
+
+void applyDrift() {
+  if (drift == 0 || drift_u_time == 0 || millis() - drift_millis < drift_check_interval || !RTCisrunning()) {
+    return;
+  }
+  drift_millis = millis();
+
+  uint32_t rtc_u_time = rtc.now().unixtime();
+  drift_pending = (int64_t)(int32_t)(rtc_u_time - drift_u_time) * drift / 1000000;
+  if (drift_pending != 0) {
+    wakeTask(drift_task, 0);
+  }
+}
+
+// Writing the seconds restarts the RTC's divider, so the correction is written just after a tick
+// and the sub-second shift it causes is carried over to the millisecond correction instead of lost.
+void writeDrift() {
+  if (drift_pending == 0 || !RTCisrunning()) {
+    return;
+  }
+
+  uint32_t since_tick = (millis() - clock_millis) % 1000;
+  if (since_tick > drift_write_window) {
+    wakeTask(drift_task, (1000 - since_tick) * 1000);
+    return;
+  }
+
+  uint32_t write_millis = millis();
+  uint32_t u_time = clock_u_time + (write_millis - clock_millis) / 1000 - drift_pending;
+  rtc.adjust(DateTime(u_time));
+  clock_correction += since_tick;
+  clock_u_time = u_time;
+  clock_millis = write_millis;
+  #ifdef sqw_interrupt
+    sqw_synced_ticks = 0;
+  #endif
+
+  drift_applied += drift_pending;
+  drift_u_time = u_time;
+  drift_pending = 0;
+}
+
 void note(String text) {
+  #ifdef metrics
+    uint32_t metrics_micros = micros();
+  #endif
+  #ifdef step_trace
+    uint32_t trace_cycles = ESP.getCycleCount();
+  #endif
+
   String log_text = strContains(text, "iDom") ? "\n[" : "[";
   if (RTCisrunning()) {
-    DateTime now = rtc.now();
+    DateTime now = getDateTime();
     log_text += now.day();
     log_text += ".";
     log_text += now.month();
@@ -235,11 +906,270 @@ void note(String text) {
     if (file) {
       file.println(log_text);
       file.close();
+      #ifdef metrics
+        flash_writes_counter++;
+      #endif
+    }
+  }
+
+  #ifdef metrics
+    observe(note_metric, metrics_micros);
+  #endif
+  #ifdef step_trace
+    if (keep_log) {
+      traceSite("flash", trace_cycles);
+    }
+  #endif
+}
+
+int addTask(const char *name, void (*callback)(), uint32_t period, uint32_t budget, uint32_t deadline) {
+  if (tasks_count == tasks_limit) {
+    return -1;
+  }
+
+  tasks_array[tasks_count].name = name;
+  tasks_array[tasks_count].callback = callback;
+  tasks_array[tasks_count].period = period;
+  tasks_array[tasks_count].budget = budget;
+  tasks_array[tasks_count].deadline = deadline;
+  tasks_array[tasks_count].active = period > 0;
+  tasks_array[tasks_count].due_micros = micros();
+  tasks_array[tasks_count].runs = 0;
+  tasks_array[tasks_count].overruns = 0;
+  tasks_array[tasks_count].max_runtime = 0;
+  tasks_array[tasks_count].runtime = 0;
+
+  return tasks_count++;
+}
+
+void wakeTask(int task, uint32_t delay_micros) {
+  if (task < 0 || task >= tasks_count) {
+    return;
+  }
+
+  tasks_array[task].active = true;
+  tasks_array[task].due_micros = micros() + delay_micros;
+}
+
+void setTaskPeriod(int task, uint32_t period) {
+  if (task < 0 || task >= tasks_count || tasks_array[task].period == period) {
+    return;
+  }
+
+  tasks_array[task].due_micros += period - tasks_array[task].period;
+  tasks_array[task].period = period;
+}
+
+void runTasks() {
+  uint32_t frame_micros = micros();
+
+  for (int i = 0; i < tasks_count; i++) {
+    uint32_t start_micros = micros();
+    int32_t lateness = start_micros - tasks_array[i].due_micros;
+    if (!tasks_array[i].active || lateness < 0) {
+      continue;
+    }
+    if (start_micros - frame_micros > tasks_frame && (uint32_t)lateness < tasks_array[i].deadline) {
+      continue;
+    }
+
+    #ifdef step_trace
+      uint32_t trace_cycles = ESP.getCycleCount();
+    #endif
+    if (tasks_array[i].period > 0) {
+      tasks_array[i].due_micros = start_micros + tasks_array[i].period;
+    } else {
+      tasks_array[i].active = false;
+    }
+
+    tasks_array[i].callback();
+
+    uint32_t runtime = micros() - start_micros;
+    tasks_array[i].runs++;
+    tasks_array[i].runtime += runtime;
+    if (runtime > tasks_array[i].max_runtime) {
+      tasks_array[i].max_runtime = runtime;
+    }
+    if (runtime > tasks_array[i].budget) {
+      tasks_array[i].overruns++;
+    }
+    #ifdef step_trace
+      traceSite(tasks_array[i].name, trace_cycles);
+    #endif
+  }
+}
+
+uint32_t nextTaskDue(uint32_t min_period) {
+  uint32_t now_micros = micros();
+  uint32_t due = UINT32_MAX;
+
+  for (int i = 0; i < tasks_count; i++) {
+    if (!tasks_array[i].active || (tasks_array[i].period > 0 && tasks_array[i].period < min_period)) {
+      continue;
+    }
+    int32_t remaining = tasks_array[i].due_micros - now_micros;
+    if (remaining <= 0) {
+      return 0;
+    }
+    if ((uint32_t)remaining < due) {
+      due = remaining;
+    }
+  }
+
+  return due;
+}
+
+uint32_t nextSmartDue() { // The automation only has to run at the minutes, at which some rule or the daily checks can trigger.
+  if (!RTCisrunning()) {
+    return sleep_limit;
+  }
+
+  DateTime now = getDateTime();
+  int current_time = (now.hour() * 60) + now.minute();
+  int next_time = 1440;
+  int times[7] = {60, 120, 180, 181, next_sunset, next_sunrise, -1};
+
+  for (int i = 0; i < 7; i++) {
+    if (times[i] > current_time && times[i] < next_time) {
+      next_time = times[i];
+    }
+  }
+
+  for (int i = 0; i < smart_count; i++) {
+    if (!smart_array[i].enabled || smart_array[i].merged) {
+      continue;
+    }
+    #ifdef light_switch
+      if (smart_array[i].switch_offset_countdown > -1) {
+        return 1000000;
+      }
+    #endif
+    #ifdef blinds
+      if (smart_array[i].blinds_offset_countdown > -1) {
+        return 1000000;
+      }
+    #endif
+    #ifdef thermostat
+      if (smart_array[i].thermostat_offset_countdown > -1) {
+        return 1000000;
+      }
+    #endif
+    #ifdef chain
+      if (smart_array[i].chain_offset_countdown > -1) {
+        return 1000000;
+      }
+    #endif
+    times[0] = smart_array[i].at_time;
+    times[1] = smart_array[i].start_time > -1 ? smart_array[i].start_time + 1 : -1;
+    times[2] = smart_array[i].end_time;
+    times[3] = smart_array[i].at_sunset && next_sunset > -1 ? verifiedTime(next_sunset + smart_array[i].sunset_offset) : -1;
+    times[4] = smart_array[i].at_sunrise && next_sunrise > -1 ? verifiedTime(next_sunrise + smart_array[i].sunrise_offset) : -1;
+    times[5] = smart_array[i].at_dusk > -1 && smart_array[i].local_dusk_time > -1 ? verifiedTime(smart_array[i].local_dusk_time + smart_array[i].dusk_offset) : -1;
+    times[6] = smart_array[i].at_dawn > -1 && smart_array[i].local_dawn_time > -1 ? verifiedTime(smart_array[i].local_dawn_time + smart_array[i].dawn_offset) : -1;
+    for (int j = 0; j < 7; j++) {
+      if (times[j] > current_time && times[j] < next_time) {
+        next_time = times[j];
+      }
+    }
+  }
+
+  uint32_t seconds = ((next_time - current_time) * 60) - now.second();
+  return min(seconds, sleep_limit / 1000000) * 1000000;
+}
+
+void idleSleep(bool idle) {
+  sleep_micros = 0;
+
+  if (!idle_sleep || !idle || wifi_state != wifi_connected) {
+    if (sleeping) {
+      WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+      sleeping = false;
+    }
+    return;
+  }
+
+  if (!sleeping) {
+    WiFi.setSleepMode(WIFI_LIGHT_SLEEP, sleep_listen_interval);
+    sleeping = true;
+  }
+
+  if (ntp_pending || ntp_resolving) {
+    return;
+  }
+
+  uint32_t due = min(min(nextTaskDue(sleep_task_period), nextSmartDue()), sleep_limit);
+  if (due < 1000) {
+    return;
+  }
+
+  sleep_micros = micros();
+  uint32_t poll_micros = sleep_micros;
+  uint32_t wifi_micros = sleep_micros;
+  while (micros() - sleep_micros < due) {
+    if (server.getServer().hasClient()) {
+      sleep_request_micros = poll_micros;
+      break;
+    }
+    if (receivedMulticastData()) { // A group move announced over multicast must not wait for the end of the slice.
+      break;
+    }
+    MDNS.update(); // The tasks skipped by the slice, serviced at the poll pace, so mDNS queries, OTA and Wi-Fi events are not left waiting.
+    ArduinoOTA.handle();
+    poll_micros = micros();
+    if (poll_micros - wifi_micros >= sleep_wifi_period) {
+      wifi_micros = poll_micros;
+      handleWifi();
+      if (wifi_state != wifi_connected) {
+        break;
+      }
     }
+    delay(min(sleep_poll, due - (poll_micros - sleep_micros)) / 1000 + 1);
   }
+  #ifdef metrics
+    observe(sleep_metric, sleep_micros);
+  #endif
+}
+
+bool isRawBody() {
+  return !strContains(server.header("Content-Type"), "multipart/");
+}
+
+// Bodies come in through the raw handler, so an oversized one is refused by its Content-Length and never buffered.
+void receivedRawBody() {
+  if (!isRawBody()) {
+    return;
+  }
+
+  HTTPRaw& raw = server.raw();
+  if (raw.status == RAW_START) {
+    raw_body = "";
+    raw_too_large = server.clientContentLength() > payload_limit;
+    if (!raw_too_large) {
+      raw_body.reserve(server.clientContentLength());
+    }
+  }
+  if (raw.status == RAW_WRITE && !raw_too_large) {
+    raw_body.concat((const char*)raw.buf, raw.currentSize);
+  }
+  if (raw.status == RAW_ABORTED) {
+    raw_body = "";
+  }
+}
+
+bool isPayloadTooLarge() {
+  if (raw_too_large || (server.hasArg("plain") && server.arg("plain").length() > payload_limit)) {
+    raw_too_large = false;
+    raw_body = "";
+    server.send(413, "text/plain", "Payload too large");
+    return true;
+  }
+  return false;
 }
 
-bool writeObjectToFile(String name, DynamicJsonDocument object) {
+bool writeObjectToFile(String name, const JsonDocument& object) {
+  #ifdef step_trace
+    uint32_t trace_cycles = ESP.getCycleCount();
+  #endif
   name = "/" + name + ".txt";
   bool result = false;
 
@@ -247,8 +1177,14 @@ bool writeObjectToFile(String name, DynamicJsonDocument object) {
   if (file && object.size() > 0) {
     result = serializeJson(object, file) > 2;
     file.close();
+    #ifdef metrics
+      flash_writes_counter++;
+    #endif
   }
 
+  #ifdef step_trace
+    traceSite("flash", trace_cycles);
+  #endif
   return result;
 }
 
@@ -267,6 +1203,24 @@ String get1(String text, int index, char separator) {
   return found > index ? text.substring(str_index[0], str_index[1]) : "";
 }
 
+bool nextSlice(const String& text, unsigned int& position, char separator, Slice& slice) {
+  if (position > text.length()) {
+    return false;
+  }
+
+  slice.start = text.c_str() + position;
+  const char *end = (const char*)memchr(slice.start, separator, text.length() - position);
+  slice.length = end ? end - slice.start : text.length() - position;
+  position += slice.length + 1;
+  return true;
+}
+
+String sliceToString(const Slice& slice) {
+  String result;
+  result.concat(slice.start, slice.length);
+  return result;
+}
+
 String oldSmart2NewSmart(const String& smart_string) {
   String result;
 
@@ -274,18 +1228,13 @@ String oldSmart2NewSmart(const String& smart_string) {
     return "";
   }
 
-  int count = 1;
-  for (char c: smart_string) {
-    if (c == ',') {
-      count++;
-    }
-  }
-
   String single_smart_string = "";
+  unsigned int position = 0;
+  Slice slice;
 
-  for (int i = 0; i < count; i++) {
-    single_smart_string = get1(smart_string, i, ',');
-    if (strContains(single_smart_string, String(smart_prefix))) {
+  while (nextSlice(smart_string, position, ',', slice)) {
+    if (memchr(slice.start, smart_prefix, slice.length)) {
+      single_smart_string = sliceToString(slice);
       if (result.length() > 0) {
         result += ",";
       }
@@ -423,7 +1372,13 @@ String getSmartString(bool raw) {
 }
 
 DynamicJsonDocument getSmartJson(bool raw) {
-  DynamicJsonDocument json_object(smart_count * 400);
+  size_t strings_size = 0;
+  if (raw) {
+    for (int i = 0; i < smart_count; i++) {
+      strings_size += smart_array[i].smart_string.length() + 1;
+    }
+  }
+  DynamicJsonDocument json_object(JSON_OBJECT_SIZE(1) + smart_count * (raw ? smart_raw_json_size : smart_json_size) + strings_size);
   int i = -1;
   bool local_result;
   int count = -1;
@@ -455,6 +1410,13 @@ DynamicJsonDocument getSmartJson(bool raw) {
       if (smart_array[i].days != "ouehras") {
         json_object[String(count)]["days"] = smart_array[i].days;
       }
+      json_object[String(count)]["evaluations"] = smart_array[i].evaluations;
+      json_object[String(count)]["matches"] = smart_array[i].matches;
+      json_object[String(count)]["fired"] = smart_array[i].fired;
+      if (smart_array[i].fired_u_time > 0) {
+        json_object[String(count)]["last_fired"] = smart_array[i].fired_u_time;
+      }
+      json_object[String(count)]["evaluation_micros"] = smart_array[i].evaluation_micros;
       #if defined(light_switch) || defined(blinds)
         if (smart_array[i].what != "?") {
           json_object[String(count)]["what"] = smart_array[i].what.toInt();
@@ -625,6 +1587,8 @@ DynamicJsonDocument getSmartJson(bool raw) {
   }
   if (raw) {
     json_object["count"] = count + 1;
+  } else if (smart_analysis.length() > 0) {
+    json_object["analysis"] = smart_analysis.c_str();
   }
 
   return json_object;
@@ -636,7 +1600,13 @@ void readSmart() {
     return;
   }
 
-  DynamicJsonDocument json_object(smart_count * 400);
+  if (file.size() > smart_count * smart_raw_json_size + smart_string_limit) {
+    note("Smart file error: too large");
+    file.close();
+    return;
+  }
+
+  DynamicJsonDocument json_object(JSON_OBJECT_SIZE(1) + smart_count * (JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(8)) + file.size()); // The copied strings are never longer than the file.
   DeserializationError deserialization_error = deserializeJson(json_object, file);
 
   if (deserialization_error) {
@@ -705,214 +1675,494 @@ void readSmart() {
 }
 
 void setSmart(const String& smart_string) {
+  invalidateSchedule();
   if (smart_string.length() < 2) {
     smart_count = 0;
+    smart_analysis = "";
     return;
   }
 
-  int count = 1;
   smart_count = 1;
   for (char b: smart_string) {
-    if (b == ',') {
-      count++;
-    }
     if (b == smart_prefix) {
       smart_count++;
     }
   }
 
+  if (smart_count > smart_limit) {
+    smart_count = smart_limit;
+  }
+
   if (smart_array != 0) {
     delete [] smart_array;
   }
   smart_array = new Smart[smart_count];
+  smart_size = smart_count;
   smart_count = 0;
 
-  String single_smart_string;
+  unsigned int position = 0;
+  Slice slice;
 
-  for (int i = 0; i < count; i++) {
-    single_smart_string = get1(smart_string, i, ',');
-    if (smart_prefix == single_smart_string.charAt(0)) {
-      smart_array[smart_count].smart_string = single_smart_string;
-      smart_array[smart_count].enabled = !strContains(single_smart_string, "/");
-
-      String substring = single_smart_string.substring(0, single_smart_string.indexOf(strContains(single_smart_string, "|") ? "|" : "&"));
-      smart_array[smart_count].days = strContains(substring, "o") ? "o" : "";
-      smart_array[smart_count].days += strContains(substring, "u") ? "u" : "";
-      smart_array[smart_count].days += strContains(substring, "e") ? "e" : "";
-      smart_array[smart_count].days += strContains(substring, "h") ? "h" : "";
-      smart_array[smart_count].days += strContains(substring, "r") ? "r" : "";
-      smart_array[smart_count].days += strContains(substring, "a") ? "a" : "";
-      smart_array[smart_count].days += strContains(substring, "s") ? "s" : "";
-      if (smart_array[smart_count].days == "") {
-        smart_array[smart_count].days = "ouehras";
-      }
+  while (nextSlice(smart_string, position, ',', slice)) {
+    if (slice.length > 0 && smart_prefix == slice.start[0] && smart_count == smart_limit) {
+      note("Smart limit exceeded, " + String(smart_limit) + " saved");
+      break;
+    }
+    if (slice.length > 0 && smart_prefix == slice.start[0]) {
+      compileSmart(smart_array[smart_count], sliceToString(slice));
+      smart_count++;
+    }
+  }
+  restoreSmart();
+}
 
-      #if defined(light_switch) || defined(blinds)
-        smart_array[smart_count].what = strContains(substring, 1) ? "1" : "";
-        smart_array[smart_count].what += strContains(substring, 2) ? "2" : "";
-        smart_array[smart_count].what += strContains(substring, 3) ? "3" : "";
-        smart_array[smart_count].what += strContains(substring, 4) ? "123" : "";
-        if (smart_array[smart_count].what == "") {
-          smart_array[smart_count].what = "?";
-        }
-      #endif
+bool resizeSmart(int size) {
+  Smart *resized = new (std::nothrow) Smart[size];
+  if (resized == 0) {
+    note("Smart error: no memory for " + String(size) + " rules");
+    return false;
+  }
+  for (int i = 0; i < min(smart_size, size); i++) {
+    resized[i] = std::move(smart_array[i]);
+  }
+  if (smart_array != 0) {
+    delete [] smart_array;
+  }
+  smart_array = resized;
+  smart_size = size;
+  return true;
+}
+
+// The rules are kept one per line outside the settings, so neither saving nor loading builds the whole smart string.
+bool loadRules() {
+  smart_count = 0;
+  smart_analysis = "";
+  File file = LittleFS.open("/rules.txt", "r");
+  if (!file) {
+    return false;
+  }
 
-      smart_array[smart_count].any_trigger_required = strContains(single_smart_string, "&");
+  int count = 0;
+  while (file.available()) {
+    if (file.read() == '\n') {
+      count++;
+    }
+  }
+  count = min(count, smart_limit);
 
-      smart_array[smart_count].action = "?";
-      if (smart_array[smart_count].any_trigger_required) {
-        if (strContains(single_smart_string, "|")) {
-          smart_array[smart_count].action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.indexOf("&"));
-        }
-        single_smart_string = single_smart_string.substring(single_smart_string.indexOf("&") + 1);
+  if (count > smart_size) {
+    if (smart_array != 0) {
+      delete [] smart_array;
+      smart_array = 0;
+    }
+    smart_size = 0;
+    if (!resizeSmart(count)) {
+      file.close();
+      return false;
+    }
+  }
+
+  String rule;
+  file.seek(0);
+  while (file.available() && smart_count < count) {
+    rule = file.readStringUntil('\n');
+    if (rule.length() > 0 && rule[0] == smart_prefix) {
+      compileSmart(smart_array[smart_count], rule);
+      smart_count++;
+    }
+  }
+  file.close();
+
+  restoreSmart();
+  return true;
+}
+
+bool saveRules() {
+  File file = LittleFS.open("/rules.tmp", "w");
+  if (!file) {
+    note("Smart error: the rules cannot be saved");
+    return false;
+  }
+
+  for (int i = 0; i < smart_count; i++) {
+    file.print(smart_array[i].smart_string);
+    file.print('\n');
+  }
+  file.close();
+  #ifdef metrics
+    flash_writes_counter++;
+  #endif
+
+  return LittleFS.rename("/rules.tmp", "/rules.txt");
+}
+
+void compileSmart(Smart& smart, String single_smart_string) {
+  smart.smart_string = single_smart_string;
+  smart.enabled = !strContains(single_smart_string, "/");
+
+  String substring = single_smart_string.substring(0, single_smart_string.indexOf(strContains(single_smart_string, "|") ? "|" : "&"));
+  smart.days = strContains(substring, "o") ? "o" : "";
+  smart.days += strContains(substring, "u") ? "u" : "";
+  smart.days += strContains(substring, "e") ? "e" : "";
+  smart.days += strContains(substring, "h") ? "h" : "";
+  smart.days += strContains(substring, "r") ? "r" : "";
+  smart.days += strContains(substring, "a") ? "a" : "";
+  smart.days += strContains(substring, "s") ? "s" : "";
+  if (smart.days == "") {
+    smart.days = "ouehras";
+  }
+
+  #if defined(light_switch) || defined(blinds)
+    smart.what = strContains(substring, 1) ? "1" : "";
+    smart.what += strContains(substring, 2) ? "2" : "";
+    smart.what += strContains(substring, 3) ? "3" : "";
+    smart.what += strContains(substring, 4) ? "123" : "";
+    if (smart.what == "") {
+      smart.what = "?";
+    }
+  #endif
+
+  smart.any_trigger_required = strContains(single_smart_string, "&");
+
+  smart.action = "?";
+  if (smart.any_trigger_required) {
+    if (strContains(single_smart_string, "|")) {
+      smart.action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.indexOf("&"));
+    }
+    single_smart_string = single_smart_string.substring(single_smart_string.indexOf("&") + 1);
+  } else {
+    if (single_smart_string.indexOf("|") != single_smart_string.lastIndexOf("|")) {
+      smart.action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.lastIndexOf("|"));
+    }
+    single_smart_string = single_smart_string.substring(single_smart_string.lastIndexOf("|") + 1);
+  }
+
+  smart.twilight_must_be_ = "?";
+  if (strContains(single_smart_string, "r2(")) {
+    substring = single_smart_string.substring(single_smart_string.indexOf("r2("), single_smart_string.indexOf(")", single_smart_string.indexOf("r2(")) + 1);
+    smart.twilight_must_be_ = substring.substring(substring.indexOf("r2(") + 3, substring.indexOf(")", substring.indexOf("r2(")));
+    single_smart_string.replace(substring, "");
+  }
+
+  smart.must_be_ = "?";
+  if (strContains(single_smart_string, "r(")) {
+    smart.must_be_ = single_smart_string.substring(single_smart_string.indexOf("r(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("r(")));
+  }
+
+  smart.at_time = -1;
+  if (strContains(single_smart_string, "_")) {
+    smart.at_time = isStringDigit(single_smart_string.substring(0, single_smart_string.indexOf("_")), "-1").toInt();
+  }
+
+  smart.start_time = -1;
+  smart.end_time = -1;
+  if (strContains(single_smart_string, "h(")) {
+    smart.start_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("h(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("h("))), "-1").toInt();
+    smart.end_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("h(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("h("))), "-1").toInt();
+  }
+
+  smart.at_sunset = strContains(single_smart_string, "n");
+  smart.sunset_offset = 0;
+  smart.has_lowering_at_sunset_offset = false;
+  if (strContains(single_smart_string, "n(")) {
+    smart.sunset_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("n(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("n("))), "0").toInt();
+  }
+
+  smart.at_sunrise = strContains(single_smart_string, "d");
+  smart.sunrise_offset = 0;
+  if (strContains(single_smart_string, "d(")) {
+    smart.sunrise_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("d(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("d("))), "0").toInt();
+  }
+
+  smart.at_dusk = -1;
+  smart.local_dusk_time = -1;
+  smart.dusk_offset = 0;
+  smart.dusk_day = 0;
+  if (strContains(single_smart_string, "<")) {
+    smart.at_dusk = 0;
+    if (strContains(single_smart_string, "<(")) {
+      smart.at_dusk = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("<(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("<("))), "0").toInt();
+      smart.dusk_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("<(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("<("))), "0").toInt();
+    }
+  }
+
+  smart.at_dawn = -1;
+  smart.local_dawn_time = -1;
+  smart.dawn_offset = 0;
+  smart.dawn_day = 0;
+  if (strContains(single_smart_string, ">")) {
+    smart.at_dawn = 0;
+    if (strContains(single_smart_string, ">(")) {
+      smart.at_dawn = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(">(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf(">("))), "0").toInt();
+      smart.dawn_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf(">(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf(">("))), "0").toInt();
+    }
+  }
+
+  if (strContains(single_smart_string, "z")) {
+    smart.at_dusk = 0;
+    smart.local_dusk_time = -1;
+    smart.dusk_day = -1;
+    smart.at_dawn = 0;
+    smart.local_dawn_time = -1;
+    smart.dawn_day = -1;
+    if (strContains(single_smart_string, "z(")) {
+      smart.dusk_offset = single_smart_string.substring(single_smart_string.indexOf("z(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("z("))).toInt();
+      smart.dawn_offset = smart.dusk_offset;
+    }
+  }
+
+  #ifdef light_switch
+    smart.at_switch = "?";
+    smart.switch_offset = 0;
+    smart.switch_offset_countdown = -1;
+    if (strContains(single_smart_string, "l(")) {
+      if (strContains(single_smart_string.substring(single_smart_string.indexOf("l("), single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), ";")) {
+        smart.at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("l(")));
+        smart.switch_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("l(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), "0").toInt();
       } else {
-        if (single_smart_string.indexOf("|") != single_smart_string.lastIndexOf("|")) {
-          smart_array[smart_count].action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.lastIndexOf("|"));
-        }
-        single_smart_string = single_smart_string.substring(single_smart_string.lastIndexOf("|") + 1);
+        smart.at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("l(")));
       }
+    }
+  #endif
 
-      smart_array[smart_count].twilight_must_be_ = "?";
-      if (strContains(single_smart_string, "r2(")) {
-        substring = single_smart_string.substring(single_smart_string.indexOf("r2("), single_smart_string.indexOf(")", single_smart_string.indexOf("r2(")) + 1);
-        smart_array[smart_count].twilight_must_be_ = substring.substring(substring.indexOf("r2(") + 3, substring.indexOf(")", substring.indexOf("r2(")));
-        single_smart_string.replace(substring, "");
+  #ifdef blinds
+    smart.at_blinds = "?";
+    smart.blinds_offset = 0;
+    smart.blinds_offset_countdown = -1;
+    if (strContains(single_smart_string, "b(")) {
+    int semicolon = 0;
+    for (char b: smart.smart_string) b == ';' ? semicolon++ : false;
+      if (semicolon == 1 || semicolon == 3) {
+        smart.at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(0, single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";"));
+        smart.blinds_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";") + 1), "0").toInt();
+      } else {
+        smart.at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b(")));
       }
+    }
+  #endif
 
-      smart_array[smart_count].must_be_ = "?";
-      if (strContains(single_smart_string, "r(")) {
-        smart_array[smart_count].must_be_ = single_smart_string.substring(single_smart_string.indexOf("r(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("r(")));
+  #ifdef thermostat
+    smart.at_thermostat = "?";
+    smart.thermostat_offset = 0;
+    smart.thermostat_offset_countdown = 0;
+    if (strContains(single_smart_string, "t(")) {
+      if (strContains(single_smart_string.substring(single_smart_string.indexOf("t("), single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), ";")) {
+        smart.at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("t("))), "?");
+        smart.thermostat_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("t(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "0").toInt();
+      } else {
+        smart.at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "?");
       }
+    }
+  #endif
 
-      smart_array[smart_count].at_time = -1;
-      if (strContains(single_smart_string, "_")) {
-        smart_array[smart_count].at_time = isStringDigit(single_smart_string.substring(0, single_smart_string.indexOf("_")), "-1").toInt();
+  #ifdef chain
+    smart.at_chain = "?";
+    smart.chain_offset = 0;
+    smart.chain_offset_countdown = -1;
+    if (strContains(single_smart_string, "c(")) {
+      if (strContains(single_smart_string.substring(single_smart_string.indexOf("c("), single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), ";")) {
+        smart.at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("c(")));
+        smart.chain_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("c(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), "0").toInt();
+      } else {
+        smart.at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("c(")));
       }
+    }
+  #endif
 
-      smart_array[smart_count].start_time = -1;
-      smart_array[smart_count].end_time = -1;
-      if (strContains(single_smart_string, "h(")) {
-        smart_array[smart_count].start_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("h(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("h("))), "-1").toInt();
-        smart_array[smart_count].end_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("h(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("h("))), "-1").toInt();
-      }
+  smart.lead_u_time = 0;
+  if (strContains(single_smart_string, "e(")) {
+      smart.lead_u_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("e(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("e("))), "0").toInt();
+  }
+}
 
-      smart_array[smart_count].at_sunset = strContains(single_smart_string, "n");
-      smart_array[smart_count].sunset_offset = 0;
-      smart_array[smart_count].has_lowering_at_sunset_offset = false;
-      if (strContains(single_smart_string, "n(")) {
-        smart_array[smart_count].sunset_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("n(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("n("))), "0").toInt();
-      }
+void restoreSmart() { // Every install starts the counters over, also for the rules kept in place by a streamed update.
+  for (int i = 0; i < smart_count; i++) {
+    smart_array[i].evaluations = 0;
+    smart_array[i].matches = 0;
+    smart_array[i].fired = 0;
+    smart_array[i].fired_u_time = 0;
+    smart_array[i].evaluation_micros = 0;
+  }
+  readSmart();
 
-      smart_array[smart_count].at_sunrise = strContains(single_smart_string, "d");
-      smart_array[smart_count].sunrise_offset = 0;
-      if (strContains(single_smart_string, "d(")) {
-        smart_array[smart_count].sunrise_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("d(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("d("))), "0").toInt();
-      }
+  smart_analysis = analyzeSmart();
+  if (smart_analysis.length() > 0) {
+    note("Smart analysis:" + smart_analysis);
+  }
+}
 
-      smart_array[smart_count].at_dusk = -1;
-      smart_array[smart_count].local_dusk_time = -1;
-      smart_array[smart_count].dusk_offset = 0;
-      smart_array[smart_count].dusk_day = 0;
-      if (strContains(single_smart_string, "<")) {
-        smart_array[smart_count].at_dusk = 0;
-        if (strContains(single_smart_string, "<(")) {
-          smart_array[smart_count].at_dusk = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("<(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("<("))), "0").toInt();
-          smart_array[smart_count].dusk_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("<(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("<("))), "0").toInt();
-        }
-      }
+bool isSameSmart(int i, int j) {
+  bool result = smart_array[i].action == smart_array[j].action
+    && smart_array[i].any_trigger_required == smart_array[j].any_trigger_required
+    && smart_array[i].at_time == smart_array[j].at_time
+    && smart_array[i].start_time == smart_array[j].start_time
+    && smart_array[i].end_time == smart_array[j].end_time
+    && smart_array[i].at_sunset == smart_array[j].at_sunset
+    && smart_array[i].sunset_offset == smart_array[j].sunset_offset
+    && smart_array[i].at_sunrise == smart_array[j].at_sunrise
+    && smart_array[i].sunrise_offset == smart_array[j].sunrise_offset
+    && smart_array[i].at_dusk == smart_array[j].at_dusk
+    && smart_array[i].dusk_offset == smart_array[j].dusk_offset
+    && smart_array[i].at_dawn == smart_array[j].at_dawn
+    && smart_array[i].dawn_offset == smart_array[j].dawn_offset
+    && smart_array[i].must_be_ == smart_array[j].must_be_
+    && smart_array[i].twilight_must_be_ == smart_array[j].twilight_must_be_;
+  #if defined(light_switch) || defined(blinds)
+    result &= smart_array[i].what == smart_array[j].what;
+  #endif
+  #ifdef light_switch
+    result &= smart_array[i].at_switch == smart_array[j].at_switch && smart_array[i].switch_offset == smart_array[j].switch_offset;
+  #endif
+  #ifdef blinds
+    result &= smart_array[i].at_blinds == smart_array[j].at_blinds && smart_array[i].blinds_offset == smart_array[j].blinds_offset;
+  #endif
+  #ifdef thermostat
+    result &= smart_array[i].at_thermostat == smart_array[j].at_thermostat && smart_array[i].thermostat_offset == smart_array[j].thermostat_offset;
+  #endif
+  #ifdef chain
+    result &= smart_array[i].at_chain == smart_array[j].at_chain && smart_array[i].chain_offset == smart_array[j].chain_offset;
+  #endif
+  return result;
+}
 
-      smart_array[smart_count].at_dawn = -1;
-      smart_array[smart_count].local_dawn_time = -1;
-      smart_array[smart_count].dawn_offset = 0;
-      smart_array[smart_count].dawn_day = 0;
-      if (strContains(single_smart_string, ">")) {
-        smart_array[smart_count].at_dawn = 0;
-        if (strContains(single_smart_string, ">(")) {
-          smart_array[smart_count].at_dawn = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(">(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf(">("))), "0").toInt();
-          smart_array[smart_count].dawn_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf(">(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf(">("))), "0").toInt();
-        }
-      }
+bool hasSmartDays(int i, int j) { // Whether every day of the rule i is also a day of the rule j.
+  for (char day: smart_array[i].days) {
+    if (!strContains(smart_array[j].days, String(day))) {
+      return false;
+    }
+  }
+  return true;
+}
 
-      if (strContains(single_smart_string, "z")) {
-        smart_array[smart_count].at_dusk = 0;
-        smart_array[smart_count].local_dusk_time = -1;
-        smart_array[smart_count].dusk_day = -1;
-        smart_array[smart_count].at_dawn = 0;
-        smart_array[smart_count].local_dawn_time = -1;
-        smart_array[smart_count].dawn_day = -1;
-        if (strContains(single_smart_string, "z(")) {
-          smart_array[smart_count].dusk_offset = single_smart_string.substring(single_smart_string.indexOf("z(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("z("))).toInt();
-          smart_array[smart_count].dawn_offset = smart_array[smart_count].dusk_offset;
-        }
-      }
+String sharedTrigger(int i, int j) {
+  if (smart_array[i].any_trigger_required || smart_array[j].any_trigger_required) {
+    return "";
+  }
+  if (smart_array[i].at_time > -1 && smart_array[i].at_time == smart_array[j].at_time) {
+    return "time";
+  }
+  if (smart_array[i].at_sunset && smart_array[j].at_sunset && smart_array[i].sunset_offset == smart_array[j].sunset_offset) {
+    return "sunset";
+  }
+  if (smart_array[i].at_sunrise && smart_array[j].at_sunrise && smart_array[i].sunrise_offset == smart_array[j].sunrise_offset) {
+    return "sunrise";
+  }
+  if (smart_array[i].at_dusk > -1 && smart_array[i].at_dusk == smart_array[j].at_dusk && smart_array[i].dusk_offset == smart_array[j].dusk_offset) {
+    return "dusk";
+  }
+  if (smart_array[i].at_dawn > -1 && smart_array[i].at_dawn == smart_array[j].at_dawn && smart_array[i].dawn_offset == smart_array[j].dawn_offset) {
+    return "dawn";
+  }
+  #ifdef chain
+    if (smart_array[i].at_chain != "?" && smart_array[i].at_chain == smart_array[j].at_chain && smart_array[i].chain_offset == smart_array[j].chain_offset) {
+      return "chain";
+    }
+  #endif
+  return "";
+}
 
-      #ifdef light_switch
-        smart_array[smart_count].at_switch = "?";
-        smart_array[smart_count].switch_offset = 0;
-        smart_array[smart_count].switch_offset_countdown = -1;
-        if (strContains(single_smart_string, "l(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("l("), single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), ";")) {
-            smart_array[smart_count].at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("l(")));
-            smart_array[smart_count].switch_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("l(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("l(")));
-          }
-        }
-      #endif
+String firedAction(int i, String trigger) {
+  if (smart_array[i].action == "?" || strContains(smart_array[i].action, ".")) {
+    return trigger == "sunrise" || trigger == "dawn" ? "0" : "100";
+  }
+  return smart_array[i].action;
+}
 
-      #ifdef blinds
-        smart_array[smart_count].at_blinds = "?";
-        smart_array[smart_count].blinds_offset = 0;
-        smart_array[smart_count].blinds_offset_countdown = -1;
-        if (strContains(single_smart_string, "b(")) {
-        int semicolon = 0;
-        for (char b: smart_string) b == ';' ? semicolon++ : false;
-          if (semicolon == 1 || semicolon == 3) {
-            smart_array[smart_count].at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(0, single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";"));
-            smart_array[smart_count].blinds_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";") + 1), "0").toInt();
-          } else {
-            smart_array[smart_count].at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b(")));
-          }
-        }
-      #endif
+bool canSmartFire(int i) {
+  if (smart_array[i].at_time == -1 && smart_array[i].start_time == -1 && smart_array[i].end_time == -1
+  && !smart_array[i].at_sunset && !smart_array[i].at_sunrise && smart_array[i].at_dusk == -1 && smart_array[i].at_dawn == -1) {
+    bool result = false;
+    #ifdef light_switch
+      result |= smart_array[i].at_switch != "?";
+    #endif
+    #ifdef blinds
+      result |= smart_array[i].at_blinds != "?";
+    #endif
+    #ifdef thermostat
+      result |= smart_array[i].at_thermostat != "?";
+    #endif
+    #ifdef chain
+      result |= smart_array[i].at_chain != "?";
+    #endif
+    if (!result) {
+      return false;
+    }
+  }
+  if (smart_array[i].at_time > 1439 || abs(smart_array[i].sunset_offset) > 1439 || abs(smart_array[i].sunrise_offset) > 1439) {
+    return false;
+  }
+  if (smart_array[i].any_trigger_required && smart_array[i].end_time > -1) {
+    if (smart_array[i].start_time > -1 && smart_array[i].start_time + 1 >= smart_array[i].end_time) {
+      return false;
+    }
+    if (smart_array[i].at_time >= smart_array[i].end_time) {
+      return false;
+    }
+  }
+  if ((strContains(smart_array[i].twilight_must_be_, "n") && strContains(smart_array[i].twilight_must_be_, "d"))
+  || (strContains(smart_array[i].twilight_must_be_, "<") && strContains(smart_array[i].twilight_must_be_, ">"))) {
+    return false;
+  }
+  #ifdef chain
+    if (smart_array[i].must_be_ == "<0" || (strContains(smart_array[i].must_be_, ">") && smart_array[i].must_be_.substring(1).toInt() >= 100)) {
+      return false;
+    }
+  #endif
+  return true;
+}
 
-      #ifdef thermostat
-        smart_array[smart_count].at_thermostat = "?";
-        smart_array[smart_count].thermostat_offset = 0;
-        smart_array[smart_count].thermostat_offset_countdown = 0;
-        if (strContains(single_smart_string, "t(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("t("), single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), ";")) {
-            smart_array[smart_count].at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("t("))), "?");
-            smart_array[smart_count].thermostat_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("t(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "?");
+String analyzeSmart() {
+  String result = "";
+  String trigger;
+  int i;
+  int j;
+
+  for (i = 0; i < smart_count; i++) {
+    smart_array[i].merged = false;
+  }
+
+  for (i = 0; i < smart_count; i++) {
+    if (!smart_array[i].enabled) {
+      continue;
+    }
+    if (!canSmartFire(i)) {
+      result += "\n " + String(i) + " never fires";
+      continue;
+    }
+
+    for (j = 0; j < i && !smart_array[i].merged; j++) {
+      if (!smart_array[j].enabled || smart_array[j].merged || !canSmartFire(j)) {
+        continue;
+      }
+      if (isSameSmart(i, j)) {
+        if (hasSmartDays(i, j)) {
+          smart_array[i].merged = true;
+          result += "\n " + String(i) + " duplicates " + String(j);
+        } else {
+          if (hasSmartDays(j, i)) {
+            smart_array[j].merged = true;
+            result += "\n " + String(j) + " duplicates " + String(i);
           }
         }
-      #endif
+        continue;
+      }
 
-      #ifdef chain
-        smart_array[smart_count].at_chain = "?";
-        smart_array[smart_count].chain_offset = 0;
-        smart_array[smart_count].chain_offset_countdown = -1;
-        if (strContains(single_smart_string, "c(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("c("), single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), ";")) {
-            smart_array[smart_count].at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("c(")));
-            smart_array[smart_count].chain_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("c(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("c(")));
+      trigger = sharedTrigger(i, j);
+      if (trigger.length() > 0
+      && (strContains(smart_array[i].action, ".") && strContains(smart_array[i].action, ";")) == (strContains(smart_array[j].action, ".") && strContains(smart_array[j].action, ";"))
+      && smart_array[i].must_be_ == smart_array[j].must_be_ && smart_array[i].twilight_must_be_ == smart_array[j].twilight_must_be_
+      && firedAction(i, trigger) != firedAction(j, trigger)) {
+        for (char day: smart_array[i].days) {
+          if (strContains(smart_array[j].days, String(day))) {
+            result += "\n " + String(i) + " conflicts with " + String(j) + " at " + trigger;
+            break;
           }
         }
-      #endif
-
-      smart_array[smart_count].lead_u_time = 0;
-      if (strContains(single_smart_string, "e(")) {
-          smart_array[smart_count].lead_u_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("e(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("e("))), "0").toInt();
       }
-
-      smart_count++;
     }
   }
-  readSmart();
+
+  return result;
 }
 
 int verifiedTime(int time) {
@@ -927,8 +2177,12 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
     return;
   }
 
+  #ifdef metrics
+    uint32_t metrics_micros = micros();
+  #endif
+
   int current_time = -1;
-  DateTime now = rtc.now();
+  DateTime now = getDateTime();
   current_time = (now.hour() * 60) + now.minute();
 
   if (current_time == -1) {
@@ -966,8 +2220,11 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
   String action;
   String log_text = "";
   String local_log = "";
+  uint32_t rule_micros;
   while (++i < smart_count) {
-    if (smart_array[i].enabled && strContains(smart_array[i].days, days_of_the_week[now.dayOfTheWeek()])) {
+    if (smart_array[i].enabled && !smart_array[i].merged && strContains(smart_array[i].days, days_of_the_week[now.dayOfTheWeek()])) {
+      rule_micros = micros();
+      smart_array[i].evaluations++;
       local_result = false;
       some_activation = false;
       at_time_result = false;
@@ -1316,6 +2573,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       #endif
 
       if (local_result) {
+        smart_array[i].matches++;
         if (at_sunset_result) {
           action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
           if (local_log.length() > 2) {
@@ -1446,6 +2704,8 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           local_log = (smart_array[i].any_trigger_required ? " after " : " at ") + local_log;
           if (strContains(action, ".") && strContains(action, ";") && action.indexOf(".") < action.indexOf(";")) {
             putOfflineData(action.substring(0, action.indexOf(";")), "{\"val\":\"" + action.substring(action.indexOf(";") + 1) + "\"}");
+            smart_array[i].fired++;
+            smart_array[i].fired_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
             log_text = "Action " + action + local_log;
           } else {
             #ifdef light_switch
@@ -1474,6 +2734,8 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
                 }
                 log_text += (smart_array[i].action != "?" ? action : (strContains(action, 1) ? "On" : "Off")) + local_log;
                 result |= true;
+                smart_array[i].fired++;
+                smart_array[i].fired_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
                 smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
                 if (strContains(smart_array[i].smart_string, "e(")) {
                   smart_array[i].smart_string.replace(
@@ -1520,6 +2782,8 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
                   log_text += (action == "100" ? "Lowering" : "Lifting") + local_log;
                 }
                 result |= true;
+                smart_array[i].fired++;
+                smart_array[i].fired_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
                 if (at_sunset_result && !calendar_twilight) {
                   smart_array[i].has_lowering_at_sunset_offset = true;
                 }
@@ -1545,6 +2809,8 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
               if (new_heating != heating && !smart_lock) {
                 log_text = (strContains(action, ".") ? ("Up to " + action + "°C") : String("Heating ") + (strContains(action, "1") ? "on" : "off")) + local_log;
                 result |= true;
+                smart_array[i].fired++;
+                smart_array[i].fired_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
                 smart_heating = i;
                 smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
                 if (strContains(smart_array[i].smart_string, "e(")) {
@@ -1566,6 +2832,8 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
                   log_text = (action == "100" ? "Opening" : "Closing") + local_log;
                 }
                 result |= true;
+                smart_array[i].fired++;
+                smart_array[i].fired_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
                 if (at_sunset_result && !calendar_twilight) {
                   smart_array[i].has_lowering_at_sunset_offset = true;
                 }
@@ -1583,6 +2851,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
       }
+      smart_array[i].evaluation_micros += micros() - rule_micros;
     }
   }
 
@@ -1652,6 +2921,10 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       setHeating(heating, "minimum");
     }
   #endif
+
+  #ifdef metrics
+    observe(smart_action_metric, metrics_micros);
+  #endif
 }
 
 
@@ -1661,91 +2934,197 @@ void connectingToWifi(bool use_wps) {
     return;
   }
 
-  String log_text = "Connecting to Wi-Fi";
-  Serial.print("\n" + log_text);
+  Serial.print("\nConnecting to Wi-Fi");
 
+  if (!wifi_connected_handler) {
+    wifi_connected_handler = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP& event) {
+      wifi_got_ip = true;
+    });
+    wifi_disconnected_handler = WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected& event) {
+      wifi_lost = true;
+    });
+  }
 
   WiFi.mode(WIFI_STA);
 
-  if (ssid.length() > 0 && password.length() > 0) {
-    WiFi.begin(ssid.c_str(), password.c_str());
-  } else {
-    WiFi.begin();
-  }
+  uint8_t bssid[6];
+  wifi_fast = ssid.length() > 0 && password.length() > 0 && wifi_channel > 0 && isLeaseValid() && stringToBSSID(wifi_bssid, bssid);
 
-  int timeout = 0;
-  while (timeout++ < 10 && WiFi.status() != WL_CONNECTED) {
-    delay(250);
-    Serial.print(".");
-    delay(250);
+  if (wifi_fast) {
+    WiFi.config(wifi_ip, wifi_gateway, wifi_subnet, wifi_dns);
+    WiFi.begin(ssid.c_str(), password.c_str(), wifi_channel, bssid);
+  } else {
+    WiFi.config(0u, 0u, 0u);
+    if (ssid.length() > 0 && password.length() > 0) {
+      WiFi.begin(ssid.c_str(), password.c_str());
+    } else {
+      WiFi.begin();
+    }
   }
 
-  bool result = WiFi.status() == WL_CONNECTED;
+  wifi_state = wifi_connecting;
+  wifi_use_wps = use_wps;
+  wifi_millis = millis();
+}
 
-  if (result) {
-    log_text = "Connected to " + WiFi.SSID();
-    log_text += " : " + WiFi.localIP().toString();
-    if (password.length() == 0) {
-      password = WiFi.psk();
-        saveSettings(false);
-    }
-  } else {
-    log_text += " timed out";
+bool stringToBSSID(String text, uint8_t *bssid) {
+  if (text.length() != 17) {
+    return false;
   }
-  note(log_text);
-
-  if (result) {
-    startServices();
-    WiFi.setAutoReconnect(true);
-    auto_reconnect = true;
-  } else {
-    if (use_wps) {
-      initiatingWPS();
-    }
+  for (int i = 0; i < 6; i++) {
+    bssid[i] = strtol(text.substring(i * 3, i * 3 + 2).c_str(), NULL, 16);
   }
+  return true;
 }
 
-void initiatingWPS() {
-  String log_text = "Initiating WPS";
-  Serial.print("\n" + log_text);
+void forgetTheLease() {
+  wifi_bssid = "";
+  wifi_channel = 0;
+  wifi_ip = IPAddress();
+  wifi_gateway = IPAddress();
+  wifi_subnet = IPAddress();
+  wifi_dns = IPAddress();
+  wifi_lease_u_time = 0;
+}
+
+// The stored lease is reused without asking the DHCP server only for wifi_lease_limit seconds after it was learned.
+bool isLeaseValid() {
+  return wifi_ip.isSet() && wifi_lease_u_time > 0 && RTCisrunning() && getUnixMillis() / 1000 - wifi_lease_u_time < wifi_lease_limit;
+}
 
+void initiatingWPS() {
+  Serial.print("\nInitiating WPS");
 
   WiFi.mode(WIFI_STA);
 
   WiFi.begin("idom", "");
-  int timeout = 0;
-  while (timeout++ < 10 && WiFi.status() != WL_CONNECTED) {
-    delay(250);
-    Serial.print(".");
-    delay(250);
-  }
 
-  bool result = WiFi.beginWPSConfig();
-  result &= String(WiFi.SSID()).length() > 0;
+  wifi_state = wifi_probing;
+  wifi_millis = millis();
+}
 
-  if (result) {
-    ssid = WiFi.SSID();
-    password = WiFi.psk();
+void startWPS() {
+  WiFi.disconnect();
+  wps_status = -1;
 
-    log_text += " finished. ";
-    log_text += "Connected to " + WiFi.SSID();
-    log_text += " : " + WiFi.localIP().toString();
+  bool result = wifi_wps_disable();
+  result &= wifi_wps_enable(WPS_TYPE_PBC);
+  result &= wifi_set_wps_cb((wps_st_cb_t) &wpsStatus);
+  result &= wifi_wps_start();
+
+  if (result) {
+    wifi_state = wifi_wps;
+    wifi_millis = millis();
   } else {
-    log_text += " timed out";
+    note("Initiating WPS failed!");
+    wifi_state = wifi_idle;
   }
-  note(log_text);
+}
 
-  if (result) {
-    saveSettings();
-    startServices();
-    WiFi.setAutoReconnect(true);
-    auto_reconnect = true;
+void wpsStatus(wps_cb_status status) {
+  if (status == WPS_CB_ST_SUCCESS) {
+    wifi_wps_disable();
+    wifi_station_connect();
   }
+  wps_status = status;
 }
 
+void connectedToWifi() {
+  String log_text = "";
 
-void activationTheLog() {
-  if (keep_log) {
+  if (wifi_state == wifi_wps) {
+    ssid = WiFi.SSID();
+    password = WiFi.psk();
+    log_text = "Initiating WPS finished. ";
+    saveSettings();
+  } else {
+    if (password.length() == 0) {
+      password = WiFi.psk();
+      saveSettings(false);
+    }
+  }
+  log_text += "Connected to " + WiFi.SSID();
+  log_text += " : " + WiFi.localIP().toString();
+  log_text += " (" + String(millis() - wifi_millis) + " ms" + (wifi_fast ? ", fast" : "") + ")";
+  note(log_text);
+
+  if (!wifi_fast) { // Every DHCP connect renews the lease, so the fast path starts from what the server handed out last.
+    uint32_t lease_u_time = RTCisrunning() ? getUnixMillis() / 1000 : 0;
+    bool changed = WiFi.BSSIDstr() != wifi_bssid || WiFi.channel() != wifi_channel || WiFi.localIP() != wifi_ip || WiFi.gatewayIP() != wifi_gateway || WiFi.subnetMask() != wifi_subnet || WiFi.dnsIP() != wifi_dns;
+    wifi_bssid = WiFi.BSSIDstr();
+    wifi_channel = WiFi.channel();
+    wifi_ip = WiFi.localIP();
+    wifi_gateway = WiFi.gatewayIP();
+    wifi_subnet = WiFi.subnetMask();
+    wifi_dns = WiFi.dnsIP();
+    if (changed || lease_u_time > 0) {
+      wifi_lease_u_time = lease_u_time;
+      saveSettings(false);
+    }
+  }
+
+  wifi_state = wifi_connected;
+  if (!services) {
+    services = true;
+    services_millis = millis();
+    startServices();
+  }
+  WiFi.setAutoReconnect(true);
+  auto_reconnect = true;
+}
+
+void handleWifi() {
+  if (wifi_got_ip) {
+    wifi_got_ip = false;
+    if (wifi_state != wifi_probing) {
+      connectedToWifi();
+    }
+  }
+
+  if (wifi_lost) {
+    wifi_lost = false;
+    cancelMeasurement();
+  }
+
+  if (wifi_state == wifi_connected && wifi_fast && !isLeaseValid()) {
+    note("Renewing the lease");
+    wifi_fast = false;
+    WiFi.config(0u, 0u, 0u);
+  }
+
+  if (wifi_state == wifi_connecting && wifi_fast && millis() - wifi_millis > fast_wifi_timeout) {
+    note("Fast reconnect failed");
+    forgetTheLease();
+    connectingToWifi(wifi_use_wps);
+  }
+
+  if (wifi_state == wifi_connecting && millis() - wifi_millis > wifi_timeout) {
+    note("Connecting to Wi-Fi timed out");
+    if (wifi_use_wps) {
+      initiatingWPS();
+    } else {
+      wifi_state = wifi_idle;
+    }
+  }
+
+  if (wifi_state == wifi_probing && millis() - wifi_millis > wifi_timeout) {
+    startWPS();
+  }
+
+  if (wifi_state == wifi_wps && ((wps_status > WPS_CB_ST_SUCCESS) || millis() - wifi_millis > wps_timeout)) {
+    note("Initiating WPS timed out");
+    wifi_wps_disable();
+    wifi_state = wifi_idle;
+  }
+
+  if (wifi_state == wifi_idle && WiFi.status() != WL_CONNECTED && !auto_reconnect) {
+    connectingToWifi(true);
+  }
+}
+
+
+void activationTheLog() {
+  if (keep_log) {
     server.send(200, "text/plain", "Done");
     return;
   }
@@ -1826,50 +3205,668 @@ void getSunriseSunset(DateTime now) {
   if (calendar_twilight != !(next_sunrise < (now.hour() * 60) + now.minute() && (now.hour() * 60) + now.minute() < next_sunset)) {
     calendar_twilight = !calendar_twilight;
     saveSettings();
+    putMulticastData("{\"twilight\":" + String(calendar_twilight ? "true" : "false") + "}");
+  }
+}
+
+bool isScheduled(int i) {
+  if (!smart_array[i].enabled || smart_array[i].merged || smart_array[i].at_dusk > -1 || smart_array[i].at_dawn > -1) {
+    return false;
+  }
+  if (!(smart_array[i].at_time > -1 || smart_array[i].at_sunset || smart_array[i].at_sunrise)) {
+    return false;
+  }
+  if (!smart_array[i].any_trigger_required && (smart_array[i].start_time > -1 || smart_array[i].end_time > -1)) {
+    return false;
+  }
+  if (strContains(smart_array[i].twilight_must_be_, "<") || strContains(smart_array[i].twilight_must_be_, ">")) {
+    return false;
+  }
+  if (strContains(smart_array[i].action, ".") && strContains(smart_array[i].action, ";")) {
+    return false;
+  }
+  #ifdef light_switch
+    if (smart_array[i].at_switch != "?") {
+      return false;
+    }
+  #endif
+  #ifdef blinds
+    if (smart_array[i].at_blinds != "?") {
+      return false;
+    }
+  #endif
+  #ifdef thermostat
+    if (smart_array[i].at_thermostat != "?") {
+      return false;
+    }
+  #endif
+  #ifdef chain
+    if (smart_array[i].at_chain != "?") {
+      return false;
+    }
+  #endif
+  return true;
+}
+
+int scheduleValue(int i, int fallback) {
+  return smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? fallback : constrain(smart_array[i].action.toInt(), 0, 100);
+}
+
+void addScheduleEvent(uint32_t day_u_time, int minute, int i, int value, int sunrise, int sunset) {
+  if (minute < 0 || minute > 1439) {
+    return;
+  }
+  if (smart_array[i].start_time > -1 && !(smart_array[i].start_time < minute)) {
+    return;
+  }
+  if (smart_array[i].end_time > -1 && !(smart_array[i].end_time > minute)) {
+    return;
+  }
+  if (smart_array[i].twilight_must_be_ != "?" && sunrise > -1 && sunset > -1) {
+    bool twilight = !(sunrise < minute && minute < sunset);
+    if ((strContains(smart_array[i].twilight_must_be_, "n") && !twilight) || (strContains(smart_array[i].twilight_must_be_, "d") && twilight)) {
+      return;
+    }
+  }
+
+  // Without a buffer the events are only counted, so the buffer can be sized before they are stored.
+  if (schedule_array != 0 && schedule_count < schedule_size) {
+    schedule_array[schedule_count].u_time = day_u_time + minute * 60;
+    schedule_array[schedule_count].smart = i;
+    schedule_array[schedule_count].value = value;
+  }
+  schedule_count++;
+}
+
+void collectSchedule(DateTime now, int days) {
+  DateTime day;
+  int sunrise;
+  int sunset;
+  int minute;
+  int value;
+  for (int d = 0; d < days; d++) {
+    day = DateTime(now.year(), now.month(), now.day()) + TimeSpan(d, 0, 0, 0);
+    sunrise = -1;
+    sunset = -1;
+    if (geo_location.length() > 2) {
+      sun.setCurrentDate(day.year(), day.month(), day.day());
+      sunset = sun.calcSunset() + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
+      sunrise = sun.calcSunrise() + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
+    }
+
+    for (int i = 0; i < smart_count; i++) {
+      if (!isScheduled(i) || !strContains(smart_array[i].days, days_of_the_week[day.dayOfTheWeek()])) {
+        continue;
+      }
+      if ((smart_array[i].at_sunset || smart_array[i].at_sunrise) && sunset == -1) {
+        continue;
+      }
+
+      // Without "&" every trigger fires on its own; with it the rule fires once the last one has passed.
+      if (smart_array[i].any_trigger_required) {
+        minute = -1;
+        value = scheduleValue(i, 100);
+        if (smart_array[i].at_sunset) {
+          minute = max(minute, sunset + smart_array[i].sunset_offset);
+        }
+        if (smart_array[i].at_sunrise) {
+          minute = max(minute, sunrise + smart_array[i].sunrise_offset);
+          value = scheduleValue(i, 0);
+        }
+        if (smart_array[i].at_time > -1) {
+          minute = max(minute, smart_array[i].at_time);
+          value = scheduleValue(i, 100);
+        }
+        addScheduleEvent(day.unixtime(), minute, i, value, sunrise, sunset);
+      } else {
+        if (smart_array[i].at_sunset) {
+          addScheduleEvent(day.unixtime(), sunset + smart_array[i].sunset_offset, i, scheduleValue(i, 100), sunrise, sunset);
+        }
+        if (smart_array[i].at_sunrise) {
+          addScheduleEvent(day.unixtime(), sunrise + smart_array[i].sunrise_offset, i, scheduleValue(i, 0), sunrise, sunset);
+        }
+        if (smart_array[i].at_time > -1) {
+          addScheduleEvent(day.unixtime(), smart_array[i].at_time, i, scheduleValue(i, 100), sunrise, sunset);
+        }
+      }
+    }
+  }
+}
+
+bool planSchedule(DateTime now, int hours) {
+  int days = (now.hour() + hours) / 24 + 1;
+
+  invalidateSchedule();
+  schedule_conditional = "";
+
+  int i;
+  for (i = 0; i < smart_count; i++) {
+    if (smart_array[i].enabled && !smart_array[i].merged && !isScheduled(i)) {
+      schedule_conditional += (schedule_conditional.length() > 0 ? "," : "") + String(i);
+    }
+  }
+
+  // The plan is kept for whole days and reused by requests whose window it covers.
+  schedule_from = DateTime(now.year(), now.month(), now.day()).unixtime();
+  schedule_to = schedule_from + days * 86400;
+
+  collectSchedule(now, days);
+  if (schedule_count == 0) {
+    return true;
+  }
+
+  schedule_array = new (std::nothrow) ScheduleEvent[schedule_count];
+  if (schedule_array == 0) {
+    note("Schedule error: no memory for " + String(schedule_count) + " events");
+    invalidateSchedule();
+    return false;
+  }
+  schedule_size = schedule_count;
+  schedule_count = 0;
+  collectSchedule(now, days);
+
+  ScheduleEvent event;
+  int j;
+  for (i = 1; i < schedule_count; i++) {
+    event = schedule_array[i];
+    j = i - 1;
+    while (j >= 0 && schedule_array[j].u_time > event.u_time) {
+      schedule_array[j + 1] = schedule_array[j];
+      j--;
+    }
+    schedule_array[j + 1] = event;
+  }
+  return true;
+}
+
+void invalidateSchedule() {
+  if (schedule_array != 0) {
+    delete [] schedule_array;
+    schedule_array = 0;
+  }
+  schedule_size = 0;
+  schedule_count = 0;
+  schedule_from = 0;
+  schedule_to = 0;
+}
+
+int findMDNSDevices() { // Peers come from the installed service query, a blocking lookup would stall the tasks.
+  return devices_count;
+}
+
+void refreshMDNSDevices() {
+  if (devices_u_time > 0 && (millis() / 1000) - devices_u_time < devices_ttl) {
+    return;
+  }
+
+  for (int i = devices_count - 1; i >= 0; i--) {
+    if (devices_u_time > 0 && devices_array[i].seen_u_time < devices_u_time) {
+      forgetDevice(devices_array[i].ip);
+    }
+  }
+
+  if (devices_query) {
+    MDNS.removeServiceQuery(devices_query);
+  }
+  devices_query = MDNS.installServiceQuery("idom", "tcp", receivedMDNSDevice);
+  devices_u_time = millis() / 1000;
+}
+
+void receivedMDNSDevice(MDNSResponder::MDNSServiceInfo service_info, MDNSResponder::AnswerType answer_type, bool set_content) {
+  if (answer_type != MDNSResponder::AnswerType::IP4Address) {
+    return;
+  }
+
+  String host = service_info.hostDomain();
+  for (IPAddress ip : service_info.IP4Adresses()) {
+    if (set_content) {
+      noteDevice(ip, host.substring(host.lastIndexOf("_") + 1, host.lastIndexOf("_") + 18));
+    } else {
+      forgetDevice(ip);
+    }
+  }
+}
+
+void noteDevice(IPAddress ip, String mac) {
+  if (!ip.isSet() || ip == WiFi.localIP()) {
+    return;
+  }
+  if (mac.length() != 17 || mac.charAt(2) != ':' || mac == WiFi.macAddress()) {
+    mac = "";
+  }
+
+  int index = -1;
+  for (int i = 0; i < devices_count && index == -1; i++) {
+    if (mac.length() > 0 && devices_array[i].mac == mac) {
+      index = i;
+    }
+  }
+  for (int i = 0; i < devices_count && index == -1; i++) {
+    if (devices_array[i].ip == ip) {
+      index = i;
+    }
+  }
+
+  if (index == -1) {
+    if (devices_count < devices_limit) {
+      index = devices_count++;
+    } else {
+      index = 0;
+      for (int i = 1; i < devices_count; i++) {
+        if (devices_array[i].seen_u_time < devices_array[index].seen_u_time) {
+          index = i;
+        }
+      }
+    }
+    devices_array[index].mac = "";
+    devices_array[index].uprisings = 0;
+    devices_array[index].sequence = 0;
+  }
+
+  int i = devices_count;
+  while (--i > -1) {
+    if (i != index && devices_array[i].ip == ip) {
+      devices_array[i] = devices_array[--devices_count];
+      devices_array[devices_count].mac = "";
+      if (index == devices_count) {
+        index = i;
+      }
+    }
+  }
+
+  devices_array[index].ip = ip;
+  if (mac.length() > 0) {
+    devices_array[index].mac = mac;
+  }
+  devices_array[index].seen_u_time = millis() / 1000;
+}
+
+void forgetDevice(IPAddress ip) {
+  int i = devices_count;
+  while (--i > -1) {
+    if (devices_array[i].ip == ip) {
+      devices_array[i] = devices_array[--devices_count];
+      devices_array[devices_count].mac = "";
+    }
+  }
+}
+
+bool isNewSequence(String mac, int uprisings, uint32_t sequence) {
+  if (mac == WiFi.macAddress()) {
+    return false;
+  }
+
+  bool known = false;
+  for (int i = 0; i < devices_count; i++) {
+    if (devices_array[i].mac == mac) {
+      if (devices_array[i].uprisings == uprisings && devices_array[i].sequence >= sequence) {
+        return false;
+      }
+      devices_array[i].uprisings = uprisings;
+      devices_array[i].sequence = sequence;
+      known = true;
+    }
+  }
+  if (known) {
+    return true;
+  }
+
+  // Peers missing from the table are remembered briefly, so the same packet received per multicast and per HTTP counts once.
+  for (int i = 0; i < strangers_limit; i++) {
+    if (strangers_array[i].mac == mac && (millis() / 1000) - strangers_array[i].seen_u_time < strangers_ttl) {
+      if (strangers_array[i].uprisings == uprisings && strangers_array[i].sequence >= sequence) {
+        return false;
+      }
+      strangers_array[i].uprisings = uprisings;
+      strangers_array[i].sequence = sequence;
+      strangers_array[i].seen_u_time = millis() / 1000;
+      return true;
+    }
+  }
+
+  strangers_array[strangers_index].mac = mac;
+  strangers_array[strangers_index].uprisings = uprisings;
+  strangers_array[strangers_index].sequence = sequence;
+  strangers_array[strangers_index].seen_u_time = millis() / 1000;
+  strangers_index = (strangers_index + 1) % strangers_limit;
+
+  return true;
+}
+
+void startMulticast() {
+  multicast = multicastUdp.beginMulticast(WiFi.localIP(), multicast_ip, multicast_port);
+}
+
+void putMulticastData(String data) {
+  if (WiFi.status() != WL_CONNECTED || !multicast || data.length() < 2) {
+    return;
   }
+
+  String packet = "{\"ip\":\"" + WiFi.localIP().toString() + "\",\"id\":\"" + WiFi.macAddress() + "\"";
+  packet += ",\"up\":" + String(uprisings) + ",\"seq\":" + String(++multicast_sequence);
+  packet += "," + data.substring(1);
+
+  multicastUdp.beginPacketMulticast(multicast_ip, multicast_port, WiFi.localIP());
+  multicastUdp.write(packet.c_str(), packet.length());
+  multicastUdp.endPacket();
 }
 
-int findMDNSDevices() {
-  int n = MDNS.queryService("idom", "tcp");
+bool receivedMulticastData() {
+  if (!multicast) {
+    return false;
+  }
+
+  int size = multicastUdp.parsePacket();
+  if (size == 0) {
+    return false;
+  }
+
+  if (size > multicast_limit) {
+    multicastUdp.flush();
+    return false;
+  }
 
-  if (n > 0) {
-    delete [] devices_array;
-    devices_array = new Device[n];
-    devices_count = n;
+  char packet[multicast_limit + 1];
+  int length = multicastUdp.read(packet, multicast_limit);
+  if (length > 0) {
+    packet[length] = 0;
+    readData(String(packet), true);
+  }
+  return length > 0;
+}
 
-    for (int i = 0; i < n; ++i) {
-      devices_array[i].ip = String(MDNS.IP(i)[0]) + '.' + String(MDNS.IP(i)[1]) + '.' + String(MDNS.IP(i)[2]) + '.' + String(MDNS.IP(i)[3]);
+WiFiClient& getConnection(IPAddress ip) {
+  int index = 0;
+  for (int i = 0; i < connections_limit; i++) {
+    if (connections_array[i].ip == ip) {
+      index = i;
+      break;
+    }
+    if (connections_array[i].used_u_time < connections_array[index].used_u_time) {
+      index = i;
     }
   }
 
-  return n;
+  if (connections_array[index].ip != ip) {
+    connections_array[index].client.stop();
+    connections_array[index].ip = ip;
+  }
+  connections_array[index].used_u_time = millis() / 1000;
+
+  return connections_array[index].client;
+}
+
+void closeIdleConnections() {
+  for (int i = 0; i < connections_limit; i++) {
+    if (connections_array[i].ip.isSet() && (millis() / 1000) - connections_array[i].used_u_time > connections_idle_time) {
+      connections_array[i].client.stop();
+      connections_array[i].ip = IPAddress();
+      connections_array[i].used_u_time = 0;
+    }
+  }
 }
 
 void receivedOfflineData() {
-  if (server.hasArg("plain")) {
-    server.send(200, "text/plain", "Data has received");
-    readData(server.arg("plain"), true);
+  if (set_stream.too_large) {
+    clearStream();
+    server.send(413, "text/plain", "Payload too large");
+    return;
+  }
+  if (set_stream.rest.length() > 0 || set_stream.smart_member) {
+    // The rules are installed and analyzed before the reply, only writing them to flash waits until it is sent.
+    bool smart_change = smart_streamed > -1 && finishStreamedSmart();
+    server.send(200, "text/plain", "Data has received" + (set_stream.smart_member ? smart_analysis : ""));
+    readData("{" + set_stream.rest + "}", true);
+    if (smart_change) {
+      saveRules();
+    }
+    clearStream();
     return;
   }
 
   server.send(200, "text/plain", "Body not received");
 }
 
+// The body of /set is parsed while it arrives, the smart string is compiled rule by rule
+// into the live array and never held whole in RAM; the remaining members are handed over to readData().
+void receivedRawOfflineData() {
+  if (!isRawBody()) {
+    return;
+  }
+  HTTPRaw& raw = server.raw();
+
+  if (raw.status == RAW_START) {
+    clearStream();
+  }
+  if (raw.status == RAW_WRITE) {
+    for (size_t i = 0; i < raw.currentSize && !set_stream.too_large; i++) {
+      streamOfflineData(raw.buf[i]);
+    }
+  }
+  if (raw.status == RAW_ABORTED) {
+    clearStream();
+  }
+}
+
+void clearStream() {
+  if (smart_stream_changed) {
+    note("Smart error: the update was not completed, the saved rules are restored");
+    loadRules();
+  }
+  smart_streamed = -1;
+  smart_stream_changed = false;
+  set_stream.depth = 0;
+  set_stream.in_string = false;
+  set_stream.escape = false;
+  set_stream.unicode = 0;
+  set_stream.key_expected = false;
+  set_stream.in_key = false;
+  set_stream.in_smart = false;
+  set_stream.smart_member = false;
+  set_stream.smart_limited = false;
+  set_stream.too_large = false;
+  set_stream.smart_length = 0;
+  set_stream.key = "";
+  set_stream.member = "";
+  set_stream.rest = "";
+  set_stream.rule = "";
+}
+
+void streamOfflineData(char c) {
+  if (set_stream.in_string) {
+    if (set_stream.in_smart) {
+      streamSmart(c);
+      return;
+    }
+    set_stream.member += c;
+    if (set_stream.escape) {
+      set_stream.escape = false;
+    } else if (c == '\\') {
+      set_stream.escape = true;
+    } else if (c == '"') {
+      set_stream.in_string = false;
+      set_stream.in_key = false;
+      return;
+    }
+    if (set_stream.in_key) {
+      set_stream.key += c;
+    }
+    if (set_stream.member.length() > payload_limit) {
+      set_stream.too_large = true;
+    }
+    return;
+  }
+
+  if (isspace(c)) {
+    return;
+  }
+
+  if (set_stream.depth == 0) {
+    if (c == '{') {
+      set_stream.depth = 1;
+      set_stream.key_expected = true;
+    }
+    return;
+  }
+
+  if (set_stream.depth > 1) {
+    set_stream.member += c;
+    if (c == '"') {
+      set_stream.in_string = true;
+    } else if (c == '{' || c == '[') {
+      set_stream.depth++;
+    } else if (c == '}' || c == ']') {
+      set_stream.depth--;
+    }
+    return;
+  }
+
+  switch (c) {
+    case '"':
+      set_stream.in_string = true;
+      if (set_stream.key_expected) {
+        set_stream.key_expected = false;
+        set_stream.in_key = true;
+        set_stream.key = "";
+        set_stream.member += c;
+      } else if (set_stream.key == "smart") {
+        set_stream.in_smart = true;
+        set_stream.smart_member = true;
+        smart_streamed = 0;
+        set_stream.rule = "";
+      } else {
+        set_stream.member += c;
+      }
+      break;
+    case ',':
+    case '}':
+      finishStreamMember();
+      set_stream.key_expected = true;
+      if (c == '}') {
+        set_stream.depth = 0;
+      }
+      break;
+    case '{':
+    case '[':
+      set_stream.depth++;
+      set_stream.member += c;
+      break;
+    default:
+      set_stream.member += c;
+  }
+}
+
+void streamSmart(char c) {
+  if (set_stream.unicode > 0) {
+    if (--set_stream.unicode == 0) {
+      c = '?';
+    } else {
+      return;
+    }
+  } else if (set_stream.escape) {
+    set_stream.escape = false;
+    if (c == 'u') {
+      set_stream.unicode = 4;
+      return;
+    }
+    if (c != '"' && c != '\\' && c != '/') {
+      return;
+    }
+  } else if (c == '\\') {
+    set_stream.escape = true;
+    return;
+  } else if (c == '"') {
+    set_stream.in_string = false;
+    set_stream.in_smart = false;
+    streamRule();
+    return;
+  }
+
+  if (++set_stream.smart_length > smart_string_limit) {
+    note("Read data error: smart too large");
+    set_stream.too_large = true;
+    return;
+  }
+  if (c == ',') {
+    streamRule();
+  } else {
+    set_stream.rule += c;
+  }
+}
+
+void finishStreamMember() {
+  if (set_stream.member.length() > 0 && !(set_stream.key == "smart" && set_stream.smart_member)) {
+    if (set_stream.rest.length() > 0) {
+      set_stream.rest += ",";
+    }
+    set_stream.rest += set_stream.member;
+    if (set_stream.rest.length() > payload_limit) {
+      set_stream.too_large = true;
+    }
+  }
+  set_stream.member = "";
+  set_stream.key = "";
+}
+
+// Rules are compared with the live ones by position and only the changed ones are compiled, in place.
+// The array grows only when more rules arrive than it holds; an unfinished update restores the saved rules.
+void streamRule() {
+  if (set_stream.rule.length() > 0 && set_stream.rule[0] == smart_prefix) {
+    if (smart_streamed == smart_limit) {
+      if (!set_stream.smart_limited) {
+        note("Smart limit exceeded, " + String(smart_limit) + " saved");
+        set_stream.smart_limited = true;
+      }
+    } else if (smart_streamed >= smart_count || smart_array[smart_streamed].smart_string != set_stream.rule) {
+      if (smart_streamed == smart_size && !resizeSmart(min(smart_size > 0 ? smart_size * 2 : 4, smart_limit))) {
+        set_stream.too_large = true;
+      } else {
+        invalidateSchedule();
+        compileSmart(smart_array[smart_streamed], set_stream.rule);
+        smart_stream_changed = true;
+        smart_streamed++;
+      }
+    } else {
+      smart_streamed++;
+    }
+  }
+  set_stream.rule = "";
+}
+
+bool finishStreamedSmart() {
+  bool result = smart_stream_changed || smart_streamed != smart_count;
+  smart_count = smart_streamed;
+  smart_streamed = -1;
+  smart_stream_changed = false;
+
+  if (result) {
+    invalidateSchedule();
+    restoreSmart();
+  }
+  return result;
+}
+
 void putOfflineData(String url, String data) {
   if (WiFi.status() != WL_CONNECTED) {
     return;
   }
 
-  if (wifiClient.available() == 0) {
-    wifiClient.stop();
+  uint32_t start_time = millis();
+  IPAddress ip;
+  if (ip.fromString(url)) {
+    httpClient.begin(getConnection(ip), "http://" + url + "/set");
+  } else {
+    if (wifiClient.available() == 0) {
+      wifiClient.stop();
+    }
+    httpClient.begin(wifiClient, "http://" + url + "/set");
   }
-
-  httpClient.begin(wifiClient, "http://" + url + "/set");
+  httpClient.setReuse(true);
   httpClient.addHeader("Content-Type", "text/plain");
   int http_code = httpClient.PUT(data);
 
   if (http_code == HTTP_CODE_OK) {
-    note("Data transfer to:\n " + url + ": " + data);
+    note("Data transfer to:\n " + url + ": " + data + " (" + String(millis() - start_time) + " ms)");
   } else {
     note("Data transfer to:\n " + url + " - error "  + http_code);
   }
@@ -1895,19 +3892,16 @@ void putMultiOfflineData(String data, bool log) {
   String log_text = "";
 
   for (int i = 0; i < count; i++) {
-    if (wifiClient.available() == 0) {
-      wifiClient.stop();
-    }
-
-    httpClient.begin(wifiClient, "http://" + devices_array[i].ip + "/set");
+    httpClient.begin(getConnection(devices_array[i].ip), "http://" + devices_array[i].ip.toString() + "/set");
+    httpClient.setReuse(true);
     httpClient.addHeader("Content-Type", "text/plain");
     http_code = httpClient.PUT(data);
 
     if (log) {
       if (http_code == HTTP_CODE_OK) {
-        log_text += "\n " + devices_array[i].ip;
+        log_text += "\n " + devices_array[i].ip.toString();
       } else {
-        log_text += "\n " + devices_array[i].ip + " - error "  + http_code;
+        log_text += "\n " + devices_array[i].ip.toString() + " - error "  + http_code;
       }
     }
 
@@ -1919,48 +3913,97 @@ void putMultiOfflineData(String data, bool log) {
   }
 }
 
+// Asks one peer at a time: a run either sends the request or polls for its reply and then wakes itself again,
+// so the other tasks are held up at most by a connect within sync_connect_timeout. No connect is started while the motor moves.
 void getOfflineData() {
   if (WiFi.status() != WL_CONNECTED) {
+    sync_client.stop();
+    sync_index = -1;
     return;
   }
 
-  int count = findMDNSDevices();
-  if (count == 0) {
-    return;
+  if (sync_index == -1) {
+    if (findMDNSDevices() == 0) {
+      return;
+    }
+    sync_index = 0;
+    sync_millis = 0;
+    sync_log = "";
   }
 
-  int http_code;
-  String data;
-  String log_text = "";
+  if (sync_index >= devices_count) {
+    note("Received data..." + sync_log);
+    sync_log = "";
+    sync_index = -1;
+    return;
+  }
 
-  for (int i = 0; i < count; i++) {
-    if (wifiClient.available() == 0) {
-      wifiClient.stop();
+  if (sync_millis == 0) {
+    #ifdef chain
+      if (destination != actual || measurement) {
+        wakeTask(sync_task, sync_motion_retry);
+        return;
+      }
+    #endif
+    sync_ip = devices_array[sync_index].ip;
+    sync_client.setTimeout(sync_connect_timeout);
+    if (!sync_client.connect(sync_ip, 80)) {
+      nextOfflineData("error connect");
+      return;
     }
+    sync_client.print("POST /basicdata HTTP/1.1\r\nHost: " + sync_ip.toString() + "\r\nContent-Type: text/plain\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    sync_millis = millis();
+    sync_reply = "";
+    wakeTask(sync_task, sync_poll_interval);
+    return;
+  }
 
-    httpClient.begin(wifiClient, "http://" + devices_array[i].ip + "/basicdata");
-    httpClient.addHeader("Content-Type", "text/plain");
-    http_code = httpClient.POST("");
+  while (sync_client.available() > 0 && sync_reply.length() <= payload_limit + 256) {
+    sync_reply += (char)sync_client.read();
+  }
 
-    if (http_code == HTTP_CODE_OK) {
-      if (httpClient.getSize() > 15) {
-        data = httpClient.getString();
-        log_text +=  "\n " + devices_array[i].ip + ": ";
+  int header_end = sync_reply.indexOf("\r\n\r\n");
+  if (header_end > -1) {
+    int length_index = sync_reply.indexOf("Content-Length: ");
+    int length = length_index > -1 && length_index < header_end ? sync_reply.substring(length_index + 16, sync_reply.indexOf("\r\n", length_index)).toInt() : -1;
+    if ((length > -1 && (int)sync_reply.length() - header_end - 4 >= length) || (length == -1 && !sync_client.connected())) {
+      if (!sync_reply.startsWith("HTTP/1.1 200")) {
+        nextOfflineData("error " + sync_reply.substring(9, 12));
+        return;
+      }
+      String data = sync_reply.substring(header_end + 4);
+      sync_reply = "";
+      String log_text = "";
+      if (data.length() > 15) {
         if (strContains(data, "ip")) {
-          log_text += "{*," + data.substring(data.indexOf("\"offset"));
+          log_text = "{*," + data.substring(data.indexOf("\"offset"));
         } else {
-          log_text += data;
+          log_text = data;
         }
         readData(data, true);
       }
-    } else {
-      log_text += "\n " + devices_array[i].ip + ": error " + http_code;
+      nextOfflineData(log_text);
+      return;
     }
+  }
 
-    httpClient.end();
+  if (millis() - sync_millis > sync_timeout || sync_reply.length() > payload_limit + 256 || (!sync_client.connected() && sync_client.available() == 0)) {
+    nextOfflineData("error timeout");
+    return;
   }
 
-  note("Received data..." + log_text);
+  wakeTask(sync_task, sync_poll_interval);
+}
+
+void nextOfflineData(String log_text) {
+  sync_client.stop();
+  if (log_text.length() > 0) {
+    sync_log += "\n " + sync_ip.toString() + ": " + log_text;
+  }
+  sync_reply = "";
+  sync_millis = 0;
+  sync_index++;
+  wakeTask(sync_task, 0);
 }
 
 void setupOTA() {
@@ -2000,3 +4043,153 @@ void getRawSmartDetail() {
   serializeJson(getSmartJson(true), result);
   server.send(200, "text/plain", result);
 }
+
+const char* route(const char *uri) { // Registers a handler path for the request counters, unmatched paths share one bucket.
+  #ifdef metrics
+    for (int i = 0; i < routes_count; i++) {
+      if (strcmp(routes_array[i].uri, uri) == 0) {
+        return uri;
+      }
+    }
+    if (routes_count < routes_limit) {
+      routes_array[routes_count].uri = uri;
+      routes_array[routes_count++].count = 0;
+    }
+  #endif
+  return uri;
+}
+
+#ifdef metrics
+  void observe(Metric metric, uint32_t start_micros) {
+    uint32_t value = micros() - start_micros;
+    int i = 0;
+    while (i < metrics_buckets_count && value > metrics_buckets[i]) {
+      i++;
+    }
+    if (i < metrics_buckets_count) {
+      histograms_array[metric].buckets[i]++;
+    }
+    histograms_array[metric].count++;
+    histograms_array[metric].sum += value;
+  }
+
+  void countRoute(const String& uri) {
+    for (int i = 0; i < routes_count; i++) {
+      if (strcmp(routes_array[i].uri, uri.c_str()) == 0) {
+        routes_array[i].count++;
+        return;
+      }
+    }
+    other_routes_counter++;
+  }
+
+  void requestForMetrics() {
+    String reply = "";
+    reply.reserve(4096);
+
+    reply += "# TYPE idom_section_duration_microseconds histogram\n";
+    for (int i = 0; i < metrics_count; i++) {
+      uint32_t cumulative = 0;
+      for (int j = 0; j < metrics_buckets_count; j++) {
+        cumulative += histograms_array[i].buckets[j];
+        reply += "idom_section_duration_microseconds_bucket{section=\"" + String(metrics_names[i]) + "\",le=\"" + String(metrics_buckets[j]) + "\"} " + String(cumulative) + "\n";
+      }
+      reply += "idom_section_duration_microseconds_bucket{section=\"" + String(metrics_names[i]) + "\",le=\"+Inf\"} " + String(histograms_array[i].count) + "\n";
+      reply += "idom_section_duration_microseconds_sum{section=\"" + String(metrics_names[i]) + "\"} " + String((double)histograms_array[i].sum, 0) + "\n";
+      reply += "idom_section_duration_microseconds_count{section=\"" + String(metrics_names[i]) + "\"} " + String(histograms_array[i].count) + "\n";
+    }
+
+    reply += "# TYPE idom_http_requests_total counter\n";
+    for (int i = 0; i < routes_count; i++) {
+      reply += "idom_http_requests_total{route=\"" + String(routes_array[i].uri) + "\"} " + String(routes_array[i].count) + "\n";
+    }
+    reply += "idom_http_requests_total{route=\"other\"} " + String(other_routes_counter) + "\n";
+
+    reply += "# TYPE idom_steps_total counter\nidom_steps_total " + String(steps_counter) + "\n";
+    reply += "# TYPE idom_flash_writes_total counter\nidom_flash_writes_total " + String(flash_writes_counter) + "\n";
+    reply += "# TYPE idom_free_heap_bytes gauge\nidom_free_heap_bytes " + String(ESP.getFreeHeap()) + "\n";
+    reply += "# TYPE idom_max_free_block_bytes gauge\nidom_max_free_block_bytes " + String(ESP.getMaxFreeBlockSize()) + "\n";
+    reply += "# TYPE idom_heap_fragmentation_percent gauge\nidom_heap_fragmentation_percent " + String(ESP.getHeapFragmentation()) + "\n";
+    reply += "# TYPE idom_task_runs_total counter\n";
+    for (int i = 0; i < tasks_count; i++) {
+      reply += "idom_task_runs_total{task=\"" + String(tasks_array[i].name) + "\"} " + String(tasks_array[i].runs) + "\n";
+    }
+    reply += "# TYPE idom_task_overruns_total counter\n";
+    for (int i = 0; i < tasks_count; i++) {
+      reply += "idom_task_overruns_total{task=\"" + String(tasks_array[i].name) + "\"} " + String(tasks_array[i].overruns) + "\n";
+    }
+    reply += "# TYPE idom_task_runtime_microseconds_total counter\n";
+    for (int i = 0; i < tasks_count; i++) {
+      reply += "idom_task_runtime_microseconds_total{task=\"" + String(tasks_array[i].name) + "\"} " + String((double)tasks_array[i].runtime, 0) + "\n";
+    }
+    reply += "# TYPE idom_task_max_runtime_microseconds gauge\n";
+    for (int i = 0; i < tasks_count; i++) {
+      reply += "idom_task_max_runtime_microseconds{task=\"" + String(tasks_array[i].name) + "\"} " + String(tasks_array[i].max_runtime) + "\n";
+    }
+    reply += "# TYPE idom_sleep_request_latency_microseconds gauge\nidom_sleep_request_latency_microseconds " + String(sleep_request_latency) + "\n";
+    reply += "# TYPE idom_boot_milliseconds gauge\n";
+    reply += "idom_boot_milliseconds{phase=\"services\"} " + String(services_millis) + "\n";
+    reply += "idom_boot_milliseconds{phase=\"first_request\"} " + String(first_response_millis) + "\n";
+    #ifdef chain
+      reply += "# TYPE idom_move_latency_microseconds gauge\nidom_move_latency_microseconds " + String(move_latency) + "\n";
+      reply += "# TYPE idom_first_step_delay_microseconds gauge\nidom_first_step_delay_microseconds " + String(first_step_delay) + "\n";
+    #endif
+
+    server.send(200, "text/plain; version=0.0.4", reply);
+  }
+#endif
+
+#ifdef step_trace
+  void traceSite(const char *site, uint32_t start_cycles) {
+    uint32_t cycles = ESP.getCycleCount() - start_cycles;
+    if (trace_step_cycles > 0 && cycles > trace_site_cycles) {
+      trace_site_cycles = cycles;
+      trace_site = site;
+    }
+  }
+
+  void traceStep() {
+    uint32_t cycles = ESP.getCycleCount();
+    if (trace_step_cycles > 0) {
+      traces_array[traces_index].cycles = cycles - trace_step_cycles;
+      traces_array[traces_index].site = trace_site;
+      if (traces_array[traces_index].cycles > worst_trace.cycles) {
+        worst_trace = traces_array[traces_index];
+      }
+      traces_index = (traces_index + 1) % traces_limit;
+      if (traces_count < traces_limit) {
+        traces_count++;
+      }
+    }
+    trace_step_cycles = cycles;
+    trace_site_cycles = 0;
+    trace_site = "motion";
+  }
+
+  void traceStop() {
+    trace_step_cycles = 0;
+  }
+
+  void requestForTrace() {
+    uint32_t mhz = ESP.getCpuFreqMHz();
+    String reply = "";
+    reply.reserve(64 + traces_count * 14);
+
+    reply += "worst," + String(worst_trace.cycles / mhz) + "," + worst_trace.site + "\n";
+    reply += "interval_us,site\n";
+    for (int i = 0; i < traces_count; i++) {
+      Trace trace = traces_array[(traces_index - traces_count + i + traces_limit) % traces_limit];
+      reply += String(trace.cycles / mhz) + "," + trace.site + "\n";
+    }
+
+    server.send(200, "text/csv", reply);
+  }
+
+  void clearTheTrace() {
+    traces_index = 0;
+    traces_count = 0;
+    worst_trace = {0, "motion"};
+
+    server.send(200, "text/plain", "The trace was cleared");
+  }
+#endif
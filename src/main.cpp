@@ -11,6 +11,9 @@ void setup() {
 
   #ifdef physical_clock
     rtc.begin();
+    #ifdef sqw_interrupt
+      startSQW();
+    #endif
     note("iDom Chain " + String(version) + "." + String(core_version));
   #else
     note("iDom Chain " + String(version) + "." + String(core_version) + "wo");
@@ -20,64 +23,206 @@ void setup() {
   WiFi.hostname(host_name);
 
   if (!readSettings(0)) {
-    delay(1000);
     readSettings(1);
   }
   resume();
 
   if (RTCisrunning()) {
-    start_u_time = rtc.now().unixtime() - offset - (dst ? 3600 : 0);
+    start_u_time = getDateTime().unixtime() - offset - (dst ? 3600 : 0);
   }
 
   pinMode(bipolar_enable_pin, OUTPUT);
   pinMode(bipolar_direction_pin, OUTPUT);
   pinMode(bipolar_step_pin, OUTPUT);
+  pinMode(ms1_pin, OUTPUT);
+  pinMode(ms2_pin, OUTPUT);
+  pinMode(ms3_pin, OUTPUT);
   setStepperOff();
   setupOTA();
+  startServer();
+
+  motion_task = addTask("motion", motionTask, motion_period, 500, 0);
+  addTask("http", httpTask, 1000, 20000, 50000);
+  addTask("wifi", wifiTask, 100000, 10000, 1000000);
+  addTask("mdns", mdnsTask, 10000, 5000, 100000);
+  addTask("automation", automationTask, 100000, 20000, 900000);
+  addTask("persistence", persistenceTask, 2000000, 20000, 2000000);
+  addTask("ntp", ntpTask, 250000, 5000, 1000000);
+  sync_task = addTask("sync", getOfflineData, 0, 20000, 1000000);
+  drift_task = addTask("drift", writeDrift, 0, 5000, 20000);
+  group_task = addTask("group", groupTask, 0, 5000, 100000);
+
   connectingToWifi(false);
 }
 
 void loop() {
-  if (WiFi.status() == WL_CONNECTED) {
-    if (destination == actual) {
-      ArduinoOTA.handle();
+  #ifdef metrics
+    uint32_t metrics_micros = micros();
+  #endif
+
+  runTasks();
+
+  #ifdef metrics
+    observe(loop_metric, metrics_micros);
+  #endif
+
+  idleSleep(destination == actual && !measurement && group_u_millis == 0);
+}
+
+void motionTask() {
+  if (group_u_millis > 0 && !measurement) {
+    int64_t remaining = (int64_t)(group_u_millis - getUnixMillis());
+    if (remaining <= 0) {
+      destination = group_destination;
+      group_started = group_u_millis;
+      group_u_millis = 0;
+      if (destination != actual) {
+        move_micros = micros();
+        move_orderer = "group";
+      }
+    } else if (remaining * 1000 <= driver_wake_micros + motion_period) {
+      isDriverReady();
+      wakeTask(motion_task, max((uint32_t)remaining * 1000, driver_wake_micros));
+      return;
     }
-    server.handleClient();
-    MDNS.update();
-  } else {
-    if (!auto_reconnect) {
-      connectingToWifi(true);
+  }
+
+  if (!measurement && destination == actual && microstep == 0) {
+    if (driver_energized && (int32_t)(millis() - driver_release_millis) >= 0) {
+      releaseDriver();
     }
-    cancelMeasurement();
+    return;
   }
 
-  if (measurement) {
-    measurementRotation();
+  if (!isDriverReady()) {
     return;
   }
 
-  if (hasTimeChanged()) {
-    if (destination != actual) {
-      if (loop_u_time % 2 == 0) {
-        smartAction(5, false);
+  bool measuring = measurement;
+  if (measuring) {
+    measurementRotation();
+  } else {
+    rotation();
+  }
+  if (driver_first_step) {
+    first_step_delay = micros() - driver_micros;
+    driver_first_step = false;
+  }
+
+  if (!measuring) {
+    if (move_micros > 0) {
+      move_latency = micros() - move_micros;
+      move_micros = 0;
+    }
+    if (move_orderer.length() > 0) {
+      if (destination != actual) {
+        prepareRotation(move_orderer);
       } else {
-        saveTheState();
-        automation();
+        saveSettings(false);
       }
-    } else {
-      automation();
+      move_orderer = "";
     }
-  }
-
-  if (destination != actual) {
-    rotation();
-    if (destination == actual) {
+    if (destination == actual && microstep == 0) {
       setStepperOff();
       if (LittleFS.exists("/resume.txt")) {
         LittleFS.remove("/resume.txt");
       }
+      if (group_started > 0) {
+        putMulticastData("{\"pos\":" + getActual() + ",\"done\":" + String(group_started) + "}");
+        group_started = 0;
+      } else {
+        putMulticastData("{\"pos\":" + getActual() + "}");
+      }
+    }
+  }
+}
+
+void httpTask() {
+  if (WiFi.status() == WL_CONNECTED && destination == actual && !measurement) {
+    ArduinoOTA.handle();
+  }
+  #ifdef metrics
+    uint32_t metrics_micros = micros();
+  #endif
+  server.handleClient();
+  #ifdef metrics
+    observe(handle_client_metric, metrics_micros);
+  #endif
+}
+
+void wifiTask() {
+  handleWifi();
+}
+
+void mdnsTask() {
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+
+  MDNS.update();
+  refreshMDNSDevices();
+  closeIdleConnections();
+  receivedMulticastData();
+}
+
+void automationTask() {
+  if (measurement || !hasTimeChanged()) {
+    return;
+  }
+
+  if (destination != actual && loop_u_time % 2 == 0) {
+    smartAction(5, false);
+  } else {
+    automation();
+  }
+}
+
+void persistenceTask() {
+  if (destination != actual && !measurement) {
+    saveTheState();
+  }
+}
+
+void ntpTask() {
+  applyDrift();
+
+  if (WiFi.status() != WL_CONNECTED || !services) {
+    return;
+  }
+
+  uint32_t u_time = receivedTime();
+  if (u_time > 0) {
+    putMulticastData("{\"time\":" + String(u_time) + "}");
+  }
+  requestTime();
+}
+
+void groupTask() {
+  if (group_announcements > 0) {
+    putMulticastData(group_announcement);
+    group_announcements--;
+    wakeTask(group_task, group_repeat_interval);
+    return;
+  }
+
+  if (group_report_u_millis == 0) {
+    return;
+  }
+  if (getUnixMillis() < group_report_u_millis) {
+    wakeTask(group_task, 1000000);
+    return;
+  }
+
+  String missing = "";
+  for (int i = 0; i < group_members_count; i++) {
+    if (!group_reported[i]) {
+      missing += " " + group_members[i].toString();
     }
   }
+  if (missing.length() > 0) {
+    note("Group move not completed by" + missing);
+  }
+  group_report_u_millis = 0;
 }
 
 
@@ -97,7 +242,13 @@ bool readSettings(bool backup) {
     return false;
   }
 
-  DynamicJsonDocument json_object(1024);
+  if (file.size() > settings_json_size) {
+    note("The " + String(backup ? "backup" : "settings") + " file is too large");
+    file.close();
+    return false;
+  }
+
+  JsonDocument& json_object = settings_json;
   DeserializationError deserialization_error = deserializeJson(json_object, file);
 
   if (deserialization_error) {
@@ -119,6 +270,33 @@ bool readSettings(bool backup) {
   if (json_object.containsKey("password")) {
     password = json_object["password"].as<String>();
   }
+  if (json_object.containsKey("ntp")) {
+    ntp_server = json_object["ntp"].as<String>();
+  }
+  if (json_object.containsKey("drift")) {
+    drift = json_object["drift"].as<int>();
+  }
+  if (json_object.containsKey("bssid")) {
+    wifi_bssid = json_object["bssid"].as<String>();
+  }
+  if (json_object.containsKey("channel")) {
+    wifi_channel = json_object["channel"].as<int>();
+  }
+  if (json_object.containsKey("ip")) {
+    wifi_ip.fromString(json_object["ip"].as<String>());
+  }
+  if (json_object.containsKey("gateway")) {
+    wifi_gateway.fromString(json_object["gateway"].as<String>());
+  }
+  if (json_object.containsKey("subnet")) {
+    wifi_subnet.fromString(json_object["subnet"].as<String>());
+  }
+  if (json_object.containsKey("dns")) {
+    wifi_dns.fromString(json_object["dns"].as<String>());
+  }
+  if (json_object.containsKey("lease")) {
+    wifi_lease_u_time = json_object["lease"].as<uint32_t>();
+  }
   if (json_object.containsKey("uprisings")) {
     uprisings = json_object["uprisings"].as<int>() + 1;
   }
@@ -126,14 +304,16 @@ bool readSettings(bool backup) {
     offset = json_object["offset"].as<int>();
   }
   dst = json_object.containsKey("dst");
-  if (json_object.containsKey("smart")) {
+  if (!loadRules() && json_object.containsKey("smart")) {
     if (json_object.containsKey("ver")) {
       setSmart(json_object["smart"].as<String>());
     } else {
       setSmart(oldSmart2NewSmart(json_object["smart"].as<String>()));
     }
+    saveRules();
   }
   smart_lock = json_object.containsKey("smart_lock");
+  idle_sleep = json_object.containsKey("sleep");
   if (json_object.containsKey("location")) {
     geo_location = json_object["location"].as<String>();
     if (geo_location.length() > 2) {
@@ -154,6 +334,18 @@ bool readSettings(bool backup) {
   if (json_object.containsKey("steps")) {
     steps = json_object["steps"].as<int>();
   }
+  if (json_object.containsKey("stall")) {
+    stall_threshold = json_object["stall"].as<int>();
+  }
+  if (json_object.containsKey("microsteps")) {
+    microsteps = json_object["microsteps"].as<int>();
+  }
+  if (json_object.containsKey("settle")) {
+    settle_time = json_object["settle"].as<int>();
+  }
+  if (json_object.containsKey("group_id")) {
+    group_id = json_object["group_id"].as<int>();
+  }
   if (json_object.containsKey("destination")) {
     destination = json_object["destination"].as<int>();
     if (destination < 0) {
@@ -175,7 +367,12 @@ void saveSettings() {
 }
 
 void saveSettings(bool log) {
-  DynamicJsonDocument json_object(1024);
+  #ifdef metrics
+    uint32_t metrics_micros = micros();
+  #endif
+
+  JsonDocument& json_object = settings_json;
+  json_object.clear();
 
   json_object["ver"] = String(version) + "." + String(core_version);
   if (last_accessed_log > 0) {
@@ -187,6 +384,23 @@ void saveSettings(bool log) {
   if (password.length() > 0) {
     json_object["password"] = password;
   }
+  if (wifi_channel > 0 && wifi_ip.isSet()) {
+    json_object["bssid"] = wifi_bssid;
+    json_object["channel"] = wifi_channel;
+    json_object["ip"] = wifi_ip.toString();
+    json_object["gateway"] = wifi_gateway.toString();
+    json_object["subnet"] = wifi_subnet.toString();
+    json_object["dns"] = wifi_dns.toString();
+    if (wifi_lease_u_time > 0) {
+      json_object["lease"] = wifi_lease_u_time;
+    }
+  }
+  if (ntp_server != default_ntp_server) {
+    json_object["ntp"] = ntp_server;
+  }
+  if (drift != 0) {
+    json_object["drift"] = drift;
+  }
   json_object["uprisings"] = uprisings;
   if (offset > 0) {
     json_object["offset"] = offset;
@@ -194,12 +408,12 @@ void saveSettings(bool log) {
   if (dst) {
     json_object["dst"] = dst;
   }
-  if (smart_count > 0) {
-    json_object["smart"] = getSmartString(true);
-  }
   if (smart_lock) {
     json_object["smart_lock"] = smart_lock;
   }
+  if (idle_sleep) {
+    json_object["sleep"] = idle_sleep;
+  }
   if (geo_location != default_location) {
     json_object["location"] = geo_location;
   }
@@ -221,6 +435,18 @@ void saveSettings(bool log) {
   if (steps > 0) {
     json_object["steps"] = steps;
   }
+  if (stall_threshold > 0) {
+    json_object["stall"] = stall_threshold;
+  }
+  if (microsteps > 1) {
+    json_object["microsteps"] = microsteps;
+  }
+  if (settle_time != default_settle_time) {
+    json_object["settle"] = settle_time;
+  }
+  if (group_id > 0) {
+    json_object["group_id"] = group_id;
+  }
   if (destination > 0) {
     json_object["destination"] = destination;
   }
@@ -236,6 +462,10 @@ void saveSettings(bool log) {
   } else {
     note("Saving the settings failed!");
   }
+
+  #ifdef metrics
+    observe(save_settings_metric, metrics_micros);
+  #endif
 }
 
 void resume() {
@@ -244,7 +474,7 @@ void resume() {
     return;
   }
 
-  StaticJsonDocument<100> json_object;
+  StaticJsonDocument<resume_json_size> json_object;
   DeserializationError deserialization_error = deserializeJson(json_object, file);
   file.close();
 
@@ -267,7 +497,7 @@ void resume() {
 }
 
 void saveTheState() {
-  StaticJsonDocument<100> json_object;
+  StaticJsonDocument<resume_json_size> json_object;
 
   json_object["actual"] = actual;
 
@@ -287,38 +517,69 @@ String getActual() {
   return toPercentages(actual, steps);
 }
 
-void startServices() {
-  server.on("/hello", HTTP_POST, handshake);
-  server.on("/set", HTTP_PUT, receivedOfflineData);
-  server.on("/state", HTTP_GET, requestForState);
-  server.on("/basicdata", HTTP_POST, exchangeOfBasicData);
-  server.on("/measurement/start", HTTP_POST, makeMeasurement);
-  server.on("/measurement/cancel", HTTP_POST, cancelMeasurement);
-  server.on("/measurement/end", HTTP_POST, endMeasurement);
-  server.on("/log", HTTP_GET, requestForLogs);
-  server.on("/log", HTTP_DELETE, clearTheLog);
-  server.on("/test/smartdetail", HTTP_GET, getSmartDetail);
-  server.on("/test/smartdetail/raw", HTTP_GET, getRawSmartDetail);
-  server.on("/admin/reset", HTTP_POST, setMin);
-  server.on("/admin/setmax", HTTP_POST, setMax);
-  server.on("/admin/setasmax", HTTP_POST, setAsMax);
-  server.on("/admin/log", HTTP_POST, activationTheLog);
-  server.on("/admin/log", HTTP_DELETE, deactivationTheLog);
+void startServer() {
+  server.on(route("/hello"), HTTP_POST, handshake, receivedRawBody);
+  server.on(route("/set"), HTTP_PUT, receivedOfflineData, receivedRawOfflineData);
+  server.on(route("/state"), HTTP_GET, requestForState);
+  server.on(route("/schedule"), HTTP_GET, requestForSchedule);
+  server.on(route("/basicdata"), HTTP_POST, exchangeOfBasicData, receivedRawBody);
+  server.on(route("/move"), HTTP_POST, quickMove);
+  server.on(route("/measurement/start"), HTTP_POST, makeMeasurement);
+  server.on(route("/measurement/cancel"), HTTP_POST, cancelMeasurement);
+  server.on(route("/measurement/end"), HTTP_POST, endMeasurement);
+  server.on(route("/log"), HTTP_GET, requestForLogs);
+  server.on(route("/log"), HTTP_DELETE, clearTheLog);
+  server.on(route("/test/smartdetail"), HTTP_GET, getSmartDetail);
+  server.on(route("/test/smartdetail/raw"), HTTP_GET, getRawSmartDetail);
+  #ifdef step_trace
+    server.on(route("/test/steptrace"), HTTP_GET, requestForTrace);
+    server.on(route("/test/steptrace"), HTTP_DELETE, clearTheTrace);
+  #endif
+  server.on(route("/admin/reset"), HTTP_POST, setMin);
+  server.on(route("/admin/setmax"), HTTP_POST, setMax);
+  server.on(route("/admin/setasmax"), HTTP_POST, setAsMax);
+  server.on(route("/admin/log"), HTTP_POST, activationTheLog);
+  server.on(route("/admin/log"), HTTP_DELETE, deactivationTheLog);
+  #ifdef metrics
+    server.on(route("/metrics"), HTTP_GET, requestForMetrics);
+  #endif
+  const char *headers[] = {"Content-Type"};
+  server.collectHeaders(headers, 1);
+  server.addHook([](const String& method, const String& url, WiFiClient* client, ESP8266WebServer::ContentTypeFunction content_type) {
+    if (first_response_millis == 0) {
+      first_response_millis = millis();
+    }
+    #ifdef metrics
+      countRoute(url);
+      if (sleep_request_micros > 0) {
+        sleep_request_latency = micros() - sleep_request_micros;
+        observe(sleep_request_metric, sleep_request_micros);
+        sleep_request_micros = 0;
+      }
+    #endif
+    return ESP8266WebServer::CLIENT_REQUEST_CAN_CONTINUE;
+  });
   server.begin();
+}
 
+void startServices() {
   note(String(host_name) + (MDNS.begin(host_name) ? " started" : " unsuccessful!"));
 
   MDNS.addService("idom", "tcp", 8080);
+  startMulticast();
+  refreshMDNSDevices();
 
-  ntpClient.begin();
-  ntpClient.update();
-  readData("{\"time\":" + String(ntpClient.getEpochTime()) + "}", false);
-  getOfflineData();
+  wifiUdp.begin(ntp_local_port);
+  wakeTask(sync_task, 2000000);
 }
 
 void handshake() {
-  if (server.hasArg("plain")) {
-    readData(server.arg("plain"), true);
+  if (isPayloadTooLarge()) {
+    return;
+  }
+  if (raw_body.length() > 0) {
+    readData(raw_body, true);
+    raw_body = "";
   }
 
   String reply = "\"id\":\"" + WiFi.macAddress() + "\"";
@@ -333,6 +594,12 @@ void handshake() {
     reply += ",\"active\":" + String(millis() / 1000);
   }
   reply += ",\"uprisings\":" + String(uprisings);
+  if (drift != 0) {
+    reply += ",\"drift\":" + String(drift);
+  }
+  if (first_response_millis > 0) {
+    reply += ",\"first_response\":" + String(first_response_millis);
+  }
   if (offset > 0) {
     reply += ",\"offset\":" + String(offset);
   }
@@ -343,7 +610,7 @@ void handshake() {
     #ifdef physical_clock
       reply += ",\"rtc\":true";
     #endif
-    reply += ",\"time\":" + String(rtc.now().unixtime() - offset - (dst ? 3600 : 0));
+    reply += ",\"time\":" + String(getDateTime().unixtime() - offset - (dst ? 3600 : 0));
   }
   if (smart_count > 0) {
     reply += ",\"smart\":\"" + getSmartString(true) + "\"";
@@ -351,6 +618,9 @@ void handshake() {
   if (smart_lock) {
     reply += ",\"smart_lock\":true";
   }
+  if (idle_sleep) {
+    reply += ",\"sleep\":true";
+  }
   if (geo_location.length() > 2) {
     reply += ",\"location\":\"" + geo_location + "\"";
   }
@@ -378,12 +648,30 @@ void handshake() {
   if (steps > 0) {
     reply += ",\"steps\":" + String(steps);
   }
+  if (stall_threshold > 0) {
+    reply += ",\"stall\":" + String(stall_threshold);
+  }
+  if (stalls > 0) {
+    reply += ",\"stalls\":" + String(stalls);
+  }
+  if (microsteps > 1) {
+    reply += ",\"microsteps\":" + String(microsteps);
+  }
   if (destination > 0) {
     reply += ",\"value\":" + getValue();
   }
   if (actual > 0) {
     reply += ",\"pos\":" + actual;
   }
+  if (move_latency > 0) {
+    reply += ",\"move_latency\":" + String(move_latency);
+  }
+  if (first_step_delay > 0) {
+    reply += ",\"first_step\":" + String(first_step_delay);
+  }
+  if (settle_time != default_settle_time) {
+    reply += ",\"settle\":" + String(settle_time);
+  }
 
   Serial.print("\nHandshake");
   server.send(200, "text/plain", "{" + reply + "}");
@@ -399,9 +687,67 @@ void requestForState() {
   server.send(200, "text/plain", "{" + reply + "}");
 }
 
+void requestForSchedule() {
+  if (!RTCisrunning()) {
+    server.send(503, "text/plain", "No time");
+    return;
+  }
+
+  int hours = server.hasArg("hours") ? constrain(server.arg("hours").toInt(), 1, schedule_max_hours) : 48;
+  DateTime now = getDateTime();
+  uint32_t end_u_time = now.unixtime() + hours * 3600;
+  if ((now.unixtime() < schedule_from || end_u_time > schedule_to) && !planSchedule(now, hours)) {
+    server.send(500, "text/plain", "Out of memory");
+    return;
+  }
+
+  // Replays the planned triggers against the predicted position, the last rule of a minute wins as in smartAction().
+  int value = getValue().toInt();
+  int minute_value = -1;
+  int minute_smart = -1;
+  uint32_t minute_u_time = 0;
+  String must_be;
+  DateTime time;
+  String reply = "";
+  for (int i = 0; i <= schedule_count; i++) {
+    if (i == schedule_count || schedule_array[i].u_time != minute_u_time) {
+      if (minute_value > -1 && minute_value != value) {
+        value = minute_value;
+        time = DateTime(minute_u_time);
+        reply += reply.length() > 0 ? "," : "";
+        reply += "{\"time\":\"" + String(time.year()) + "-" + corectDateTime(time.month()) + "-" + corectDateTime(time.day())
+        + " " + corectDateTime(time.hour()) + ":" + corectDateTime(time.minute()) + "\",\"val\":" + String(value) + ",\"smart\":" + String(minute_smart) + "}";
+      }
+      minute_value = -1;
+      if (i == schedule_count || schedule_array[i].u_time >= end_u_time) {
+        break;
+      }
+      minute_u_time = schedule_array[i].u_time;
+    }
+    if (minute_u_time <= now.unixtime()) {
+      continue;
+    }
+
+    must_be = smart_array[schedule_array[i].smart].must_be_;
+    if (must_be != "?") {
+      if (strContains(must_be, "<") ? value >= must_be.substring(1).toInt() : (strContains(must_be, ">") ? value <= must_be.substring(1).toInt() : value != must_be.toInt())) {
+        continue;
+      }
+    }
+    minute_value = schedule_array[i].value;
+    minute_smart = schedule_array[i].smart;
+  }
+
+  server.send(200, "text/plain", "{\"schedule\":[" + reply + "],\"conditional\":[" + schedule_conditional + "]}");
+}
+
 void exchangeOfBasicData() {
-  if (server.hasArg("plain")) {
-    readData(server.arg("plain"), true);
+  if (isPayloadTooLarge()) {
+    return;
+  }
+  if (raw_body.length() > 0) {
+    readData(raw_body, true);
+    raw_body = "";
   }
 
   String reply = "\"ip\":\"" + WiFi.localIP().toString() + "\"" + ",\"id\":\"" + WiFi.macAddress() + "\"";
@@ -409,14 +755,92 @@ void exchangeOfBasicData() {
   reply += ",\"offset\":" + String(offset) + ",\"dst\":" + String(dst);
 
   if (RTCisrunning()) {
-    reply += ",\"time\":" + String(rtc.now().unixtime() - offset - (dst ? 3600 : 0));
+    reply += ",\"time\":" + String(getDateTime().unixtime() - offset - (dst ? 3600 : 0));
   }
 
   server.send(200, "text/plain", "{" + reply + "}");
 }
 
+void quickMove() {
+  String value = server.arg("val");
+  if (!isStringDigit(value) || value.toInt() > 100) {
+    server.send(400, "text/plain", "Wrong value");
+    return;
+  }
+
+  if (measurement) {
+    server.send(200, "text/plain", "Cannot execute");
+    return;
+  }
+
+  destination = toSteps(value.toInt(), steps);
+  if (destination != actual) {
+    move_micros = micros();
+    move_orderer = server.hasArg("apk") ? "apk" : "local";
+  }
+
+  server.send(200, "text/plain", "Done");
+}
+
+void scheduleGroupMove(int value, uint64_t at, int group) {
+  if (!RTCisrunning()) {
+    note("Group move error: the clock is not running");
+    return;
+  }
+  if (!clock_phase && !ntp_pending) { // The RTC was written since the last sync, the next group move needs its millisecond phase back.
+    ntp_next_time = 0;
+  }
+
+  if (at == 0) {
+    at = getUnixMillis() + group_lead;
+    group_initiated = at;
+    group_report_u_millis = at + (uint64_t)steps * motion_period * 2 / 1000 + group_report_margin;
+    for (int i = 0; i < group_members_count; i++) {
+      group_reported[i] = false;
+    }
+    group_announcement = "{\"val\":" + String(value) + ",\"at\":" + String(at) + ",\"group\":" + String(group) + "}";
+    group_announcements = group_repeats;
+    wakeTask(group_task, 0);
+  }
+
+  // The announcement is repeated, every copy after the first one is ignored.
+  if (group != group_id || measurement || at == group_scheduled) {
+    return;
+  }
+
+  group_destination = toSteps(value, steps);
+  group_u_millis = at;
+  group_scheduled = at;
+  note("Group move to " + String(value) + "% in " + String((int64_t)(at - getUnixMillis())) + " ms");
+}
+
+// Members are learned from their completion reports, those missing from a later move are logged.
+void noteGroupReport(String ip) {
+  IPAddress member;
+  if (!member.fromString(ip)) {
+    return;
+  }
+
+  for (int i = 0; i < group_members_count; i++) {
+    if (group_members[i] == member) {
+      group_reported[i] = true;
+      return;
+    }
+  }
+  if (group_members_count < group_members_limit) {
+    group_members[group_members_count] = member;
+    group_reported[group_members_count] = true;
+    group_members_count++;
+  }
+}
+
 void readData(const String& payload, bool per_wifi) {
-  DynamicJsonDocument json_object(1024);
+  if (payload.length() > payload_limit) {
+    note("Read data error: payload too large (" + String(payload.length()) + ")");
+    return;
+  }
+
+  JsonDocument& json_object = payload_json;
   DeserializationError deserialization_error = deserializeJson(json_object, payload);
 
   if (deserialization_error) {
@@ -431,61 +855,73 @@ void readData(const String& payload, bool per_wifi) {
 
   bool settings_change = false;
   bool twilight_change = false;
+  String multicast_data = "";
 
   if (json_object.containsKey("ip") && json_object.containsKey("id")) {
-      for (int i = 0; i < devices_count; i++) {
-        if (devices_array[i].ip == json_object["ip"].as<String>()) {
-          devices_array[i].mac = json_object["id"].as<String>();
-        }
-      }
+    IPAddress ip;
+    if (ip.fromString(json_object["ip"].as<String>())) {
+      noteDevice(ip, json_object["id"].as<String>());
+    }
+  }
+
+  if (json_object.containsKey("seq")) {
+    if (!isNewSequence(json_object["id"].as<String>(), json_object["up"].as<int>(), json_object["seq"].as<uint32_t>())) {
+      return;
+    }
   }
 
   if (json_object.containsKey("offset")) {
     if (offset != json_object["offset"].as<int>()) {
       if (RTCisrunning() && !json_object.containsKey("time")) {
-        rtc.adjust(DateTime((rtc.now().unixtime() - offset) + json_object["offset"].as<int>()));
+        adjustRTC(DateTime((getDateTime().unixtime() - offset) + json_object["offset"].as<int>()));
         note("Time zone change");
       }
       offset = json_object["offset"].as<int>();
+      invalidateSchedule();
       settings_change = true;
+      multicast_data += ",\"offset\":" + String(offset);
     }
   }
 
   if (json_object.containsKey("dst")) {
     if (dst != strContains(json_object["dst"].as<String>(), 1)) {
       dst = !dst;
+      invalidateSchedule();
       settings_change = true;
+      multicast_data += ",\"dst\":" + String(dst);
       if (RTCisrunning() && !json_object.containsKey("time")) {
-        rtc.adjust(DateTime(rtc.now().unixtime() + (dst ? 3600 : -3600)));
+        adjustRTC(DateTime(getDateTime().unixtime() + (dst ? 3600 : -3600)));
         note(dst ? "Summer time" : "Winter time");
       }
     }
   }
 
   if (json_object.containsKey("time")) {
-    int new_u_time = json_object["time"].as<int>() + offset + (dst ? 3600 : 0);
-    if (new_u_time > 1546304461) {
-      if (RTCisrunning()) {
-        if (abs(new_u_time - (int)rtc.now().unixtime()) > 60) {
-          rtc.adjust(DateTime(new_u_time));
-          note("Adjust time");
-        }
-      } else {
-        #ifdef physical_clock
-          rtc.adjust(DateTime(new_u_time));
-        #else
-          rtc.begin(DateTime(new_u_time));
-        #endif
-        note("RTC begin");
-        start_u_time = (millis() / 1000) + rtc.now().unixtime() - offset - (dst ? 3600 : 0);
+    if (adjustTime(json_object["time"].as<uint32_t>(), 60)) {
+      sync_u_time = 0;
+    }
+  }
+
+  if (json_object.containsKey("ntp") && json_object["ntp"].as<String>().length() > ntp_server_limit) {
+    note("Read data error: ntp too long");
+  } else if (json_object.containsKey("ntp")) {
+    if (ntp_server != json_object["ntp"].as<String>()) {
+      ntp_server = json_object["ntp"].as<String>();
+      if (ntp_server.length() < 2) {
+        ntp_server = default_ntp_server;
       }
+      ntp_ip = IPAddress();
+      ntp_next_time = 0;
+      settings_change = true;
     }
   }
 
-  if (json_object.containsKey("smart")) {
+  if (json_object.containsKey("smart") && json_object["smart"].as<String>().length() > smart_string_limit) {
+    note("Read data error: smart too large");
+  } else if (json_object.containsKey("smart")) {
     if (getSmartString(true) != json_object["smart"].as<String>()) {
       setSmart(json_object["smart"].as<String>());
-      settings_change = true;
+      saveRules();
     }
   }
 
@@ -496,9 +932,19 @@ void readData(const String& payload, bool per_wifi) {
     }
   }
 
-  if (json_object.containsKey("location")) {
+  if (json_object.containsKey("sleep")) {
+    if (idle_sleep != strContains(json_object["sleep"].as<String>(), 1)) {
+      idle_sleep = !idle_sleep;
+      settings_change = true;
+    }
+  }
+
+  if (json_object.containsKey("location") && json_object["location"].as<String>().length() > location_limit) {
+    note("Read data error: location too long");
+  } else if (json_object.containsKey("location")) {
     if (geo_location != json_object["location"].as<String>()) {
       geo_location = json_object["location"].as<String>();
+      invalidateSchedule();
       if (geo_location.length() > 2) {
         sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
       } else {
@@ -513,6 +959,13 @@ void readData(const String& payload, bool per_wifi) {
     }
   }
 
+  if (json_object.containsKey("twilight") && geo_location.length() < 2) {
+    if (calendar_twilight != json_object["twilight"].as<bool>()) {
+      calendar_twilight = !calendar_twilight;
+      settings_change = true;
+    }
+  }
+
   if (json_object.containsKey("tilt")) {
     if (tilt != json_object["tilt"].as<int>()) {
       tilt = json_object["tilt"].as<int>();
@@ -527,13 +980,42 @@ void readData(const String& payload, bool per_wifi) {
     }
   }
 
+  if (json_object.containsKey("stall")) {
+    if (stall_threshold != json_object["stall"].as<int>()) {
+      stall_threshold = json_object["stall"].as<int>();
+      settings_change = true;
+    }
+  }
+
+  if (json_object.containsKey("group_id")) {
+    if (group_id != json_object["group_id"].as<int>()) {
+      group_id = json_object["group_id"].as<int>();
+      settings_change = true;
+    }
+  }
+
+  if (json_object.containsKey("settle")) {
+    if (settle_time != json_object["settle"].as<int>() && json_object["settle"].as<int>() >= 0) {
+      settle_time = json_object["settle"].as<int>();
+      settings_change = true;
+    }
+  }
+
+  if (json_object.containsKey("microsteps")) {
+    int new_microsteps = json_object["microsteps"].as<int>();
+    if (microsteps != new_microsteps && (new_microsteps == 1 || new_microsteps == 2 || new_microsteps == 4 || new_microsteps == 8 || new_microsteps == 16)) {
+      microsteps = new_microsteps;
+      settings_change = true;
+    }
+  }
+
   if (json_object.containsKey("light")) {
     if (sensor_twilight != strContains(json_object["light"].as<String>(), "t")) {
       sensor_twilight = !sensor_twilight;
       twilight_change = true;
       settings_change = true;
       if (RTCisrunning()) {
-        int current_time = (rtc.now().hour() * 60) + rtc.now().minute();
+        int current_time = getMinuteOfDay();
         if (sensor_twilight) {
           if (abs(current_time - dusk_time) > 60) {
             dusk_time = current_time;
@@ -552,21 +1034,38 @@ void readData(const String& payload, bool per_wifi) {
     }
   }
 
+  bool group_move = json_object.containsKey("at") || json_object.containsKey("group");
+
   if (json_object.containsKey("val")) {
-    destination = toSteps(json_object["val"].as<int>(), steps);
+    if (group_move) {
+      scheduleGroupMove(json_object["val"].as<int>(), json_object.containsKey("at") ? (uint64_t)json_object["at"].as<double>() : 0, json_object["group"].is<int>() ? json_object["group"].as<int>() : group_id);
+    } else {
+      destination = toSteps(json_object["val"].as<int>(), steps);
+      if (destination != actual) {
+        move_micros = micros();
+      }
+    }
+  }
+
+  if (json_object.containsKey("done") && group_initiated > 0 && (uint64_t)json_object["done"].as<double>() == group_initiated) {
+    note("Group move completed by " + json_object["ip"].as<String>() + " at " + json_object["pos"].as<String>() + "%");
+    noteGroupReport(json_object["ip"].as<String>());
   }
 
   if (settings_change) {
     note("Received the data:\n " + payload);
     saveSettings();
   }
+  if (multicast_data.length() > 0 && !json_object.containsKey("seq")) {
+    putMulticastData("{" + multicast_data.substring(1) + "}");
+  }
   if (json_object.containsKey("light")) {
     smartAction(0, twilight_change);
   }
   if (json_object.containsKey("location") && RTCisrunning()) {
-    getSunriseSunset(rtc.now());
+    getSunriseSunset(getDateTime());
   }
-  if (json_object.containsKey("val")) {
+  if (json_object.containsKey("val") && !group_move) {
     if (destination != actual) {
       prepareRotation(per_wifi ? (json_object.containsKey("apk") ? "apk" : "local") : "cloud");
     }
@@ -579,14 +1078,11 @@ void automation() {
     return;
   }
 
-  DateTime now = rtc.now();
+  DateTime now = getDateTime();
   int current_time = (now.hour() * 60) + now.minute();
 
   if (now.second() == 0) {
     if (current_time == 60) {
-      ntpClient.update();
-      readData("{\"time\":" + String(ntpClient.getEpochTime()) + "}", false);
-
       if (last_accessed_log++ > 14) {
         deactivationTheLog();
       }
@@ -596,18 +1092,20 @@ void automation() {
   if (current_time == 120 || current_time == 180) {
     if (now.month() == 3 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()][0] == 's' && current_time == 120 && !dst) {
       int new_u_time = now.unixtime() + 3600;
-      rtc.adjust(DateTime(new_u_time));
+      adjustRTC(DateTime(new_u_time));
       dst = true;
       note("Setting summer time");
       saveSettings();
+      putMulticastData("{\"dst\":1}");
       getSunriseSunset(now);
     }
     if (now.month() == 10 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()][0] == 's' && current_time == 180 && dst) {
       int new_u_time = now.unixtime() - 3600;
-      rtc.adjust(DateTime(new_u_time));
+      adjustRTC(DateTime(new_u_time));
       dst = false;
       note("Setting winter time");
       saveSettings();
+      putMulticastData("{\"dst\":0}");
       getSunriseSunset(now);
     }
   }
@@ -634,6 +1132,7 @@ void automation() {
         }
         smart_lock = false;
         saveSettings();
+        putMulticastData("{\"twilight\":" + String(calendar_twilight ? "true" : "false") + "}");
       }
     }
   }
@@ -677,7 +1176,21 @@ void makeMeasurement() {
     return;
   }
 
+  measurement_limit = steps > 0 ? steps + steps / 2 : 0;
+  if (server.hasArg("limit") && isStringDigit(server.arg("limit"))) {
+    measurement_limit = server.arg("limit").toInt();
+  }
+
+  // A close may still be stepping in the microstep zone, the measurement counts full steps only.
+  setResolution(1);
+  microstep = 0;
+  if (driver_energized) {
+    driver_waking = true;
+    driver_micros = micros();
+  }
+
   measurement = true;
+  stall_detector = {0, 0, 0};
   digitalWrite(bipolar_direction_pin, HIGH);
 
   server.send(200, "text/plain", "Done");
@@ -690,6 +1203,7 @@ void cancelMeasurement() {
 
   measurement = false;
   setStepperOff();
+  setTaskPeriod(motion_task, motion_period);
 
   server.send(200, "text/plain", "Done");
 }
@@ -699,22 +1213,74 @@ void endMeasurement() {
     return;
   }
 
+  finishMeasurement();
+  server.send(200, "text/plain", "Done");
+}
+
+void finishMeasurement() {
   measurement = false;
   setStepperOff();
+  setTaskPeriod(motion_task, motion_period);
 
   steps = actual;
   destination = actual;
 
   note("Measurement completed");
   saveSettings();
-  server.send(200, "text/plain", "Done");
+}
+
+uint32_t measurementPeriod() {
+  int fast_end = steps - steps * measurement_slow_margin / 100;
+  if (steps == 0 || actual >= fast_end) {
+    return motion_period;
+  }
+
+  int edge = min(actual, fast_end - actual);
+  if (edge >= measurement_ramp_steps) {
+    return measurement_fast_period;
+  }
+  return motion_period - max(edge, 0) * (motion_period - measurement_fast_period) / measurement_ramp_steps;
 }
 
 
 void setStepperOff() {
-  digitalWrite(bipolar_enable_pin, HIGH);
   digitalWrite(bipolar_direction_pin, LOW);
   digitalWrite(bipolar_step_pin, LOW);
+  stall_detector = {0, 0, 0};
+  setResolution(1);
+  #ifdef step_trace
+    traceStop();
+  #endif
+
+  if (driver_energized) {
+    driver_release_millis = millis() + settle_time;
+  } else {
+    digitalWrite(bipolar_enable_pin, HIGH);
+  }
+}
+
+bool isDriverReady() {
+  if (!driver_energized) {
+    digitalWrite(bipolar_enable_pin, LOW);
+    driver_energized = true;
+    driver_waking = true;
+    driver_micros = micros();
+    wakeTask(motion_task, driver_wake_micros);
+    return false;
+  }
+  if (driver_waking) {
+    if (micros() - driver_micros < driver_wake_micros) {
+      return false;
+    }
+    driver_waking = false;
+    driver_first_step = true;
+  }
+  return true;
+}
+
+void releaseDriver() {
+  digitalWrite(bipolar_enable_pin, HIGH);
+  driver_energized = false;
 }
 
 void prepareRotation(String orderer) {
@@ -755,28 +1321,96 @@ void calibration(int set, bool positioning) {
 }
 
 void measurementRotation() {
-  digitalWrite(bipolar_enable_pin, LOW);
   actual++;
+  #ifdef metrics
+    steps_counter++;
+  #endif
+  #ifdef step_trace
+    traceStep();
+  #endif
 
   digitalWrite(bipolar_step_pin, HIGH);
   digitalWrite(bipolar_step_pin, LOW);
-  delay(4);
+
+  if (measurement_limit > 0 && actual >= measurement_limit) {
+    note("Measurement limit reached");
+    finishMeasurement();
+    return;
+  }
+  if (stall_threshold > 0 && actual % stall_sample_steps == 0) {
+    if (detectStall(stall_detector, analogRead(stall_pin), stall_threshold)) {
+      actual -= stallLostSteps(stall_detector);
+      note("Stall detected, " + String(stallLostSteps(stall_detector)) + " steps withdrawn");
+      finishMeasurement();
+      return;
+    }
+  }
+
+  setTaskPeriod(motion_task, measurementPeriod());
 }
 
 void rotation() {
-  if (destination != actual) {
-    digitalWrite(bipolar_direction_pin, destination > actual);
-    digitalWrite(bipolar_enable_pin, LOW);
-    if (destination > actual) {
+  bool up = destination * 16 > actual * 16 + microstep;
+
+  if (destination != actual || microstep != 0) {
+    if (up && microstep > 0) {
       actual++;
-    } else {
+      microstep -= 16;
+    }
+    if (!up && microstep < 0) {
       actual--;
+      microstep += 16;
     }
-  } else {
-    digitalWrite(bipolar_enable_pin, HIGH);
+    if (microstep == 0) {
+      setResolution(actual < microstep_zone || (steps > 0 && actual > steps - microstep_zone) ? microsteps : 1);
+    }
+
+    digitalWrite(bipolar_direction_pin, up);
+    if (microstep == 0) {
+      if (up) {
+        actual++;
+      } else {
+        actual--;
+      }
+      microstep = up ? -16 : 16;
+    }
+    microstep += up ? 16 / resolution : -16 / resolution;
+    #ifdef metrics
+      steps_counter++;
+    #endif
+    #ifdef step_trace
+      traceStep();
+    #endif
   }
 
   digitalWrite(bipolar_step_pin, HIGH);
   digitalWrite(bipolar_step_pin, LOW);
-  delay(4);
+
+  if (stall_threshold > 0 && destination != actual && microstep == 0 && actual % stall_sample_steps == 0) {
+    if (detectStall(stall_detector, analogRead(stall_pin), stall_threshold)) {
+      stopOnStall(up);
+    }
+  }
+}
+
+void stopOnStall(bool up) {
+  int lost = stallLostSteps(stall_detector);
+  actual += up ? -lost : lost;
+  destination = actual;
+  stalls++;
+
+  note("Stall detected at " + getActual() + "%, " + String(lost) + " steps withdrawn");
+  saveSettings(false);
+}
+
+void setResolution(int new_resolution) {
+  if (resolution == new_resolution) {
+    return;
+  }
+
+  resolution = new_resolution;
+  digitalWrite(ms1_pin, resolution == 2 || resolution == 8 || resolution == 16);
+  digitalWrite(ms2_pin, resolution == 4 || resolution == 8 || resolution == 16);
+  digitalWrite(ms3_pin, resolution == 16);
+  setTaskPeriod(motion_task, motion_period / resolution);
 }
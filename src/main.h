@@ -1,7 +1,11 @@
 #include <Arduino.h>
+#include "stall.h"
 
 #define physical_clock
+#define sqw_interrupt
 #define chain
+#define metrics
+// #define step_trace
 
 const char device[7] = "chain";
 const char smart_prefix = 'c';
@@ -10,15 +14,71 @@ const uint8_t version = 3;
 const int bipolar_enable_pin = D6;
 const int bipolar_direction_pin = D5;
 const int bipolar_step_pin = D3;
+const int sqw_pin = D7;
+const int stall_pin = A0;
+const int ms1_pin = D0;
+const int ms2_pin = D4;
+const int ms3_pin = D8;
 
 const int default_tilt = 10;
 int tilt = default_tilt;
 
+const size_t resume_json_size = JSON_OBJECT_SIZE(1) + 8;
+
 int steps = 0;
 int destination = 0;
 int actual = 0;
 
+const int microstep_zone = 20;
+int microsteps = 1;
+int resolution = 1;
+int microstep = 0;
+
 bool measurement = false;
+const uint32_t motion_period = 4000;
+const uint32_t measurement_fast_period = 1500;
+const int measurement_ramp_steps = 100;
+const int measurement_slow_margin = 10;
+int measurement_limit = 0;
+
+int stall_threshold = 0;
+int stalls = 0;
+StallDetector stall_detector = {0, 0, 0};
+
+String move_orderer = "";
+uint32_t move_micros = 0;
+uint32_t move_latency = 0;
+
+const uint32_t driver_wake_micros = 2000;
+const int default_settle_time = 250;
+int settle_time = default_settle_time;
+bool driver_energized = false;
+bool driver_waking = false;
+bool driver_first_step = false;
+uint32_t driver_micros = 0;
+uint32_t driver_release_millis = 0;
+uint32_t first_step_delay = 0;
+
+const uint32_t group_lead = 500;
+const int group_repeats = 3;
+const uint32_t group_repeat_interval = 100000;
+const uint32_t group_report_margin = 10000;
+const int group_members_limit = 8;
+int group_id = 0;
+int group_destination = 0;
+uint64_t group_u_millis = 0;
+uint64_t group_scheduled = 0;
+uint64_t group_started = 0;
+uint64_t group_initiated = 0;
+uint64_t group_report_u_millis = 0;
+String group_announcement = "";
+int group_announcements = 0;
+IPAddress group_members[group_members_limit];
+bool group_reported[group_members_limit];
+int group_members_count = 0;
+int group_task = -1;
+
+int motion_task = -1;
 
 String toPercentages(int value, int steps);
 int toSteps(int value, int steps);
@@ -30,10 +90,23 @@ void saveTheState();
 String getSteps();
 String getValue();
 String getActual();
+void motionTask();
+void httpTask();
+void wifiTask();
+void mdnsTask();
+void automationTask();
+void persistenceTask();
+void ntpTask();
+void groupTask();
+void startServer();
 void startServices();
 void handshake();
 void requestForState();
+void requestForSchedule();
 void exchangeOfBasicData();
+void quickMove();
+void scheduleGroupMove(int value, uint64_t at, int group);
+void noteGroupReport(String ip);
 void readData(const String& payload, bool per_wifi);
 void automation();
 void smartAction();
@@ -43,8 +116,14 @@ void setAsMax();
 void makeMeasurement();
 void cancelMeasurement();
 void endMeasurement();
+void finishMeasurement();
+uint32_t measurementPeriod();
 void setStepperOff();
+bool isDriverReady();
+void releaseDriver();
 void prepareRotation(String orderer);
 void calibration(int set, bool positioning);
 void measurementRotation();
 void rotation();
+void setResolution(int new_resolution);
+void stopOnStall(bool up);
@@ -0,0 +1,35 @@
+// Stall detection has no Arduino dependencies, so the host test in test/ replays recorded traces through it.
+#pragma once
+
+#include <stdint.h>
+
+struct StallDetector {
+  int32_t baseline;
+  int samples;
+  int over;
+};
+
+const int stall_sample_steps = 8;
+const int stall_warmup = 8;
+const int stall_confirm = 3;
+
+inline bool detectStall(StallDetector& detector, int sample, int threshold) {
+  if (detector.samples < stall_warmup) {
+    detector.baseline = detector.samples == 0 ? sample * 16 : detector.baseline + sample - detector.baseline / 16;
+    detector.samples++;
+    return false;
+  }
+
+  if (sample - detector.baseline / 16 > threshold) {
+    return ++detector.over >= stall_confirm;
+  }
+
+  detector.over = 0;
+  detector.baseline += sample - detector.baseline / 16;
+  return false;
+}
+
+// The steps taken since the first high sample, the ones the motor did not turn.
+inline int stallLostSteps(const StallDetector& detector) {
+  return detector.over > 0 ? (detector.over - 1) * stall_sample_steps : 0;
+}
@@ -0,0 +1,56 @@
+// Replays ADC traces through detectStall(), one sample per stall_sample_steps steps.
+// A trace lists the expected threshold, the index of the sample that confirms the stall (-1 for none)
+// and the steps withdrawn, each in a "# key value" header line, followed by one sample per line.
+#include <cstdio>
+#include <cstring>
+#include "../src/stall.h"
+
+bool replayTrace(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    printf("%s: cannot be read\n", path);
+    return false;
+  }
+
+  int threshold = 0;
+  int expected_stall = -1;
+  int expected_lost = 0;
+  int stall = -1;
+  int lost = 0;
+  int index = 0;
+  int value;
+  char line[128];
+  StallDetector detector = {0, 0, 0};
+
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == '#') {
+      sscanf(line, "# threshold %d", &threshold);
+      sscanf(line, "# stall %d", &expected_stall);
+      sscanf(line, "# lost %d", &expected_lost);
+      continue;
+    }
+    if (sscanf(line, "%d", &value) != 1) {
+      continue;
+    }
+    if (stall == -1 && detectStall(detector, value, threshold)) {
+      stall = index;
+      lost = stallLostSteps(detector);
+    }
+    index++;
+  }
+  fclose(file);
+
+  bool result = stall == expected_stall && lost == expected_lost;
+  printf("%s: %s (stall at %d, %d steps withdrawn; expected %d, %d)\n", path, result ? "ok" : "FAILED", stall, lost, expected_stall, expected_lost);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  int failed = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!replayTrace(argv[i])) {
+      failed++;
+    }
+  }
+  return failed > 0 ? 1 : 0;
+}